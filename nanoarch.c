@@ -4,17 +4,202 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <strings.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <linux/input.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "libretro.h"
+#include "pixconv.h"
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <alsa/asoundlib.h>
 
 static GLFWwindow *g_win = NULL;
 static snd_pcm_t *g_pcm = NULL;
+static snd_pcm_uframes_t g_pcm_buffer_size = 0;
+static unsigned g_pcm_buffer_us = 64 * 1000;
+static unsigned g_pcm_period_us = 0;  // a quarter of the buffer if unset
 static float g_scale = 3;
+static bool g_threaded = false;
+static struct retro_system_av_info g_av = {0};
+static enum retro_pixel_format g_pixel_format = RETRO_PIXEL_FORMAT_0RGB1555;
+static struct retro_hw_render_callback g_hw_render = {0};  // context_type is NONE for software cores
+
+// Software framebuffers handed to cores are aligned to this and have their
+// pitch rounded up to it.
+#define FRAMEBUFFER_ALIGN 64
+
+// Set while running frames whose output must not be presented or played.
+// Code that changes them for a nested run restores the previous values. Audio
+// is thread-local as the audio callback thread also pushes samples.
+static bool g_video_suppressed = false;
+static _Thread_local bool g_audio_suppressed = false;
+
+static atomic_bool g_paused = false;
+
+// Runs end on SIGINT or SIGTERM, or after --frames frames, as well as on the
+// quit hotkey, so headless ones can be stopped cleanly.
+static atomic_bool g_interrupted = false;
+static atomic_ulong g_frames_run = 0;
+static unsigned long g_frame_limit = 0;
+
+// Samples from the per-sample callback are staged here and written to the
+// device once per frame, or when the buffer fills.
+#define AUDIO_BATCH_FRAMES 1024
+
+static _Thread_local struct {
+	int16_t data[AUDIO_BATCH_FRAMES * 2];
+	unsigned frames;
+} g_audio_batch;
+
+static struct {
+	atomic_ulong writes;     // calls into the audio backend
+	uint64_t frames;         // retro_run calls
+	atomic_ulong xruns;      // device underruns reported by ALSA
+	atomic_ulong overruns;   // frames dropped because the ring was full
+	atomic_ulong underruns;  // times the writer thread found the ring empty
+} g_audio_stats;
+
+// Single-producer/single-consumer ring of stereo frames. Head and tail only
+// ever grow; capacity is a power of two so they wrap with a mask.
+struct audio_ring {
+	int16_t *data;
+	size_t capacity;
+	atomic_size_t head;
+	atomic_size_t tail;
+};
+
+// With --audio-async the core's callbacks only copy samples into the ring and
+// a writer thread drains it into the audio backend. The audio callback thread
+// and the emulation thread are not expected to both produce samples.
+static struct {
+	bool enabled;
+	struct audio_ring ring;
+	pthread_t thread;
+	atomic_bool quit;
+} g_audio_async = {0};
+
+// Dynamic rate control resamples the core's audio by up to max_dev either
+// side of the nominal ratio, steering the device queue towards half full so
+// small mismatches between the video and audio clocks never build up.
+#define DRC_HISTORY 3  // input frames kept between batches for the cubic taps
+
+static struct {
+	bool enabled;
+	double base_ratio;  // output frames per input frame before correction
+	double max_dev;
+	double pos;         // read position into `in`, in frames
+	float *in;          // DRC_HISTORY frames of history, then the new batch
+	float *out;
+	int16_t *out16;
+	size_t in_cap, out_cap;
+	double ratio_sum;
+	uint64_t batches;
+} g_drc = { .enabled = true, .max_dev = 0.005 };
+
+// Cores using the audio callback are asked for samples from their own thread
+// whenever the audio device can take more.
+static struct {
+	struct retro_audio_callback cb;
+	pthread_t thread;
+	atomic_bool quit;
+} g_audio_cb = {0};
+
+// Fast-forward runs the core uncapped with audio dropped, presenting every
+// `skip`th frame, or with skip 0 the newest frame once per display refresh.
+static struct {
+	atomic_bool active;
+	unsigned skip;
+	uint64_t period;    // display refresh period in ns, 0 if unknown
+	uint64_t frames;
+	uint64_t last_present;
+} g_ff = {0};
+
+// Cores using the frame time callback get the real time between retro_run
+// calls, or the reference delta when emulation isn't running in real time.
+// The first frame after a pause or a rewind gets the reference delta too, so
+// time spent there isn't handed to the core in one go.
+static struct {
+	struct retro_frame_time_callback cb;
+	uint64_t last;
+	bool fixed;
+	bool rewinding;
+	atomic_bool resync;     // set when pause toggles, possibly from the presenter
+} g_frame_time = {0};
+
+static double g_slowmo = 1;
+
+// Frame delay waits after each present before polling input and running the
+// core, so input is sampled closer to when the frame is shown. The automatic
+// mode leaves room for the slowest recent frame and backs off after misses.
+#define FRAME_DELAY_MARGIN_NS 1000000
+#define FRAME_DELAY_WINDOW 60
+
+static struct {
+	bool enabled;
+	bool automatic;
+	uint64_t delay;     // ns after the previous present
+	uint64_t period;    // ns between presents
+	uint64_t present;   // time of the previous present
+	uint64_t woke;      // time the current frame started
+	uint64_t cost_max;  // slowest frame in the current window
+	uint64_t cost_prev; // slowest frame in the previous window
+	uint64_t backoff;   // extra margin after missed deadlines
+	unsigned window;
+	unsigned clean;     // frames since the last miss or backoff step
+	uint64_t frames;
+	uint64_t delay_sum;
+	unsigned misses;
+} g_frame_delay = {0};
+
+// Run-ahead emulates this many frames past the real one each frame, presents
+// the last and rolls back, hiding the core's internal input lag.
+static struct {
+	unsigned frames;
+	void *state;
+	size_t size;
+} g_runahead = {0};
+
+// Rewind keeps a snapshot every `interval` frames in a fixed-size ring. Each
+// entry is the XOR of a snapshot with the one before it, zero-run-length
+// encoded, so applying the newest entry to `current` yields the previous
+// snapshot. Entries are framed as [u32 len][payload][u32 len] so they can be
+// evicted from the head and popped from the tail.
+static struct {
+	size_t capacity;
+	unsigned interval;
+	unsigned countdown;
+	uint8_t *ring;
+	size_t head;
+	size_t used;
+	unsigned count;
+	bool primed;        // `current` holds a snapshot
+	size_t size;        // savestate size
+	size_t words;       // savestate size in 64-bit words, zero padded
+	uint64_t *current;  // newest snapshot
+	uint64_t *scratch;  // incoming snapshot
+	uint8_t *delta;     // encoded entry being written or read
+	uint64_t pushed;
+	uint64_t pushed_bytes;
+} g_rewind = { .interval = 1 };
 
 static GLfloat g_vertex[] = {
 	-1.0f, -1.0f, // left-bottom
@@ -29,6 +214,40 @@ static GLfloat g_texcoords[] ={
 	1.0f,  0.0f,
 };
 
+static const char *g_vertex_shader =
+	"layout(location = 0) in vec2 a_pos;\n"
+	"layout(location = 1) in vec2 a_tex;\n"
+	"uniform vec2 u_scale;\n"
+	"out vec2 v_tex;\n"
+	"void main() {\n"
+	"	v_tex = a_tex * u_scale;\n"
+	"	gl_Position = vec4(a_pos, 0.0, 1.0);\n"
+	"}\n";
+
+// XRGB8888 is sampled as is, 16-bit formats are fetched as raw texels.
+static const char *g_fragment_shader =
+	"in vec2 v_tex;\n"
+	"out vec4 o_color;\n"
+	"#ifdef PACKED16\n"
+	"uniform usampler2D u_tex;\n"
+	"void main() {\n"
+	"	uint p = texelFetch(u_tex, ivec2(v_tex * vec2(textureSize(u_tex, 0))), 0).r;\n"
+	"#ifdef RGB565\n"
+	"	o_color = vec4(vec3(p >> 11, (p >> 5) & 63u, p & 31u) / vec3(31.0, 63.0, 31.0), 1.0);\n"
+	"#else\n"
+	"	o_color = vec4(vec3((p >> 10) & 31u, (p >> 5) & 31u, p & 31u) / 31.0, 1.0);\n"
+	"#endif\n"
+	"}\n"
+	"#else\n"
+	"uniform sampler2D u_tex;\n"
+	"void main() {\n"
+	"	o_color = vec4(texture(u_tex, v_tex).rgb, 1.0);\n"
+	"}\n"
+	"#endif\n";
+
+#define VIDEO_PBOS 3
+#define VIDEO_BAND_ROWS 16
+
 static struct {
 	GLuint tex_id;
 	GLuint pitch;
@@ -38,7 +257,67 @@ static struct {
 	GLuint pixfmt;
 	GLuint pixtype;
 	GLuint bpp;
-} g_video  = {0};
+	GLuint internal_fmt;
+
+	// Without a core context 16-bit frames are widened on the CPU, as many
+	// drivers convert them texel by texel otherwise.
+	pixconv_fn convert;
+	void *conv;
+	size_t conv_size;
+
+	// With a 3.3 core context the quad lives in a VBO and one program draws
+	// it, unpacking 16-bit pixels itself from an integer texture.
+	bool core_profile;
+	GLuint program;
+	GLuint vao, vbo;
+	GLint u_scale;
+
+	// Frames are copied into a ring of pixel buffer objects and uploaded from
+	// there, so the driver can DMA them while we carry on. A fence per buffer
+	// keeps it from being rewritten while its upload is still in flight.
+	bool pbo_enabled;
+	GLuint pbo[VIDEO_PBOS];
+	GLsizeiptr pbo_size[VIDEO_PBOS];
+	GLsync pbo_fence[VIDEO_PBOS];
+	unsigned pbo_next;
+	uint64_t pbo_uploads;
+	uint64_t pbo_stalls;    // uploads that had to wait for a fence
+
+	// Persistently mapped buffers lent to cores as their software framebuffer,
+	// so frames rendered into them are uploaded without any copy.
+	GLuint fb_buf[VIDEO_PBOS];
+	void *fb_map[VIDEO_PBOS];
+	GLsync fb_fence[VIDEO_PBOS];
+	size_t fb_size;
+	unsigned fb_next;
+	unsigned fb_current;
+	uint64_t fb_uploads;
+
+	// Frames are hashed in bands of rows and only the span from the first to
+	// the last band that changed is uploaded. Without anything new to show,
+	// presents can be skipped too.
+	bool diff_enabled;
+	bool diff_valid;        // band_hash describes what's in the texture
+	uint64_t *band_hash;
+	unsigned bands;
+	bool skip_present;
+	bool dirty;             // something changed since the last present
+	uint64_t bands_total;
+	uint64_t bands_uploaded;
+	uint64_t presents_skipped;
+
+	// Hardware rendered cores draw into this framebuffer object, which is
+	// blitted to the window instead of going through the texture.
+	GLuint fbo;
+	GLuint fbo_color, fbo_depth;
+	bool hw_blitted;        // the back buffer already holds the newest frame
+
+	// Offscreen, frames are drawn into this framebuffer object, as large as
+	// the window would have been, instead of the window's back buffer.
+	bool offscreen;
+	GLuint target, target_color;
+	int target_w, target_h;
+} g_video  = { .pbo_enabled = true, .diff_enabled = true, .dirty = true };
 
 
 static struct {
@@ -67,6 +346,54 @@ static struct {
 } g_retro;
 
 
+// Hotkeys reported by an input backend's pump function.
+enum {
+	HOTKEY_QUIT  = 1 << 0,
+	HOTKEY_RESET = 1 << 1,
+	HOTKEY_REWIND = 1 << 2,
+	HOTKEY_FAST_FORWARD = 1 << 3,
+	HOTKEY_PAUSE = 1 << 4,
+};
+
+// Backends are selected once at startup and called through these tables, so
+// the null implementations let nanoarch run without a window or audio device.
+struct video_backend {
+	const char *name;
+	void (*init)(void);
+	void (*configure)(const struct retro_game_geometry *geom);
+	bool (*set_pixel_format)(unsigned format);
+	bool (*set_hw_render)(struct retro_hw_render_callback *hw); // fills in the frontend's callbacks
+	void (*refresh)(const void *data, unsigned width, unsigned height, unsigned pitch);
+	void (*render)(void);
+	void (*set_vsync)(bool enabled);
+	double (*refresh_rate)(void); // display refresh in Hz, 0 if unknown
+	bool (*get_framebuffer)(struct retro_framebuffer *fb); // memory refresh uploads without a copy
+	bool (*screenshot)(const char *path); // writes the last presented frame as a PPM
+	void (*deinit)(void);
+};
+
+struct audio_backend {
+	const char *name;
+	bool (*init)(int frequency);  // false if the device isn't available
+	size_t (*write)(const void *buf, unsigned frames);
+	bool (*wait)(int timeout_ms); // blocks until the device can take more
+	double (*fill)(void);         // buffered fraction of the device queue, < 0 if unknown
+	void (*deinit)(void);
+};
+
+struct input_backend {
+	const char *name;
+	void (*init)(void);
+	unsigned (*pump)(void); // handles window events, returns HOTKEY_* flags
+	void (*poll)(void);     // snapshots the joypad state into g_joy
+	void (*deinit)(void);
+};
+
+static const struct video_backend *g_video_backend = NULL;
+static const struct audio_backend *g_audio_backend = NULL;
+static const struct input_backend *g_input_backend = NULL;
+
+
 struct keymap {
 	unsigned k;
 	unsigned rk;
@@ -89,7 +416,175 @@ struct keymap g_binds[] = {
 	{ 0, 0 }
 };
 
-static unsigned g_joy[RETRO_DEVICE_ID_JOYPAD_R3+1] = { 0 };
+struct keymap g_hotkey_binds[] = {
+	{ GLFW_KEY_ESCAPE, HOTKEY_QUIT },
+	{ GLFW_KEY_R, HOTKEY_RESET },
+	{ GLFW_KEY_TAB, HOTKEY_REWIND },
+	{ GLFW_KEY_SPACE, HOTKEY_FAST_FORWARD },
+	{ GLFW_KEY_P, HOTKEY_PAUSE },
+
+	{ 0, 0 }
+};
+
+#define MAX_PORTS 4
+
+// Joypad buttons per port as bitmasks of RETRO_DEVICE_ID_JOYPAD_*. Key events
+// update g_joy_mask as they arrive, core_input_poll snapshots it into g_joy
+// for the core to query, possibly from the emulation thread.
+static atomic_uint g_joy_mask[MAX_PORTS] = { 0 };
+static uint16_t g_joy[MAX_PORTS] = { 0 };
+
+// Held hotkeys, updated from key events like the joypad.
+static atomic_uint g_hotkey_mask = 0;
+
+// g_binds and g_hotkey_binds indexed by key, so events are handled in O(1).
+static uint16_t g_key_joy[GLFW_KEY_LAST + 1] = { 0 };
+static uint8_t g_key_hotkeys[GLFW_KEY_LAST + 1] = { 0 };
+
+// Analog sticks per port, snapshotted by core_input_poll like g_joy.
+static int16_t g_analog[MAX_PORTS][2][2] = { 0 };
+
+#define GAMEPAD_EVENTS 64
+
+// An evdev gamepad, or a file of recorded struct input_event replayed in its
+// place. The reader builds up a state from events and publishes it on every
+// SYN_REPORT through a sequence lock, so polls never see half a report.
+struct gamepad {
+	int fd;
+	bool replay;
+	bool dropped;           // skipping events until the next SYN_REPORT
+	pthread_t thread;       // replays only, devices share the epoll thread
+	struct input_absinfo abs[ABS_CNT];
+	unsigned buttons;
+	int16_t axes[2][2];
+
+	atomic_uint seq;
+	atomic_uint pub_buttons;
+	atomic_int pub_axes[2][2];
+	_Atomic uint64_t pub_stamp;  // CLOCK_MONOTONIC time of the newest event
+	uint64_t seen_stamp;         // newest report already picked up by a poll
+	unsigned seen_buttons;
+	uint64_t events;
+};
+
+static struct {
+	const char *paths[MAX_PORTS];  // --gamepad arguments, "auto" scans /dev/input
+	unsigned npaths;
+	struct gamepad pads[MAX_PORTS];
+	unsigned count;
+	int epoll;
+	int wake;
+	pthread_t thread;
+	bool running;
+	atomic_bool quit;
+	uint64_t reports;            // reports seen by polls, and their age then
+	uint64_t age_sum;
+	uint64_t age_max;
+} g_gamepad = { .epoll = -1, .wake = -1 };
+
+// Latency measurement follows each joypad button change through the pipeline:
+// when the event arrived, when the core first read it, when the next frame
+// was uploaded and when that frame was presented.
+#define LATENCY_EVENTS 64
+#define LATENCY_BINS 100  // 1 ms each, the last one also counts anything slower
+
+enum latency_stage {
+	LATENCY_FREE,
+	LATENCY_ARRIVED,   // not in an input snapshot yet
+	LATENCY_POLLED,
+	LATENCY_OBSERVED,
+	LATENCY_UPLOADED,
+};
+
+enum {
+	LATENCY_TO_OBSERVED,
+	LATENCY_TO_UPLOADED,
+	LATENCY_TO_PRESENTED,
+	LATENCY_TOTAL,
+	LATENCY_SPANS
+};
+
+static const char *g_latency_spans[] = {
+	"event to core read",
+	"core read to upload",
+	"upload to present",
+	"event to present",
+};
+
+struct latency_event {
+	enum latency_stage stage;
+	unsigned port;
+	unsigned buttons;
+	uint64_t time[LATENCY_SPANS];
+};
+
+static struct {
+	bool enabled;
+	unsigned pending;
+	struct latency_event events[LATENCY_EVENTS];
+	unsigned hist[LATENCY_SPANS][LATENCY_BINS];
+	uint64_t sum[LATENCY_SPANS];
+	uint64_t max[LATENCY_SPANS];
+	unsigned count;
+	unsigned dropped;       // evicted before the core read them
+	unsigned untracked;     // arrived with the table full of events already read
+} g_latency = {0};
+
+// Frames handed from the emulation thread to the presenter. The producer owns
+// the back slot and the consumer the front one; finished frames are swapped
+// through the middle slot with a single compare-and-swap on g_frames.state.
+struct frame {
+	void *data;
+	size_t size;
+	unsigned width, height, pitch;
+};
+
+#define FRAME_BACK(s)   ((s) & 3)
+#define FRAME_MIDDLE(s) (((s) >> 2) & 3)
+#define FRAME_FRONT(s)  (((s) >> 4) & 3)
+#define FRAME_FRESH     (1u << 6)
+
+static struct {
+	struct frame slots[3];
+	atomic_uint state;
+} g_frames = { .state = 0 | (1 << 2) | (2 << 4) };
+
+static struct {
+	pthread_t thread;
+	atomic_bool quit;
+	atomic_bool reset;
+	atomic_bool rewind;
+} g_emu;
+
+// What keeps emulation running at the core's own frame rate: blocking buffer
+// swaps, a sleep to an absolute deadline, or blocking audio writes.
+enum pace_source {
+	PACE_VSYNC,
+	PACE_TIMER,
+	PACE_AUDIO,
+	PACE_NONE,
+};
+
+static const char *g_pace_names[] = { "vsync", "timer", "audio", "none" };
+
+// Sleeping stops this short of the deadline and spins the rest, since
+// clock_nanosleep routinely overshoots by tens of microseconds.
+#define PACE_SPIN_NS 200000
+
+static struct {
+	enum pace_source source;
+	bool automatic;     // picked by default rather than with --pace
+	bool sleep;         // pace_wait sleeps instead of relying on a blocking call
+	atomic_bool audio_written;  // the frame wrote audio a blocking write could pace
+	uint64_t period;    // frame duration at the core's rate, in ns
+	uint64_t next;      // deadline of the next frame
+	uint64_t frames;
+	uint64_t late;      // accumulated time woken past the deadline
+	uint64_t max_late;
+	unsigned resyncs;
+} g_pace = { PACE_VSYNC };
+
+#define array_len(a) (sizeof(a) / sizeof((a)[0]))
 
 #define load_sym(V, S) do {\
 	if (!((*(void**)&V) = dlsym(g_retro.handle, #S))) \
@@ -113,6 +608,20 @@ static void die(const char *fmt, ...) {
 	exit(EXIT_FAILURE);
 }
 
+static uint64_t time_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static size_t framebuffer_pitch(unsigned width) {
+	size_t bpp = g_pixel_format == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+
+	return (width * bpp + FRAMEBUFFER_ALIGN - 1) & ~(size_t)(FRAMEBUFFER_ALIGN - 1);
+}
+
+
 static void refresh_vertex_data() {
 	assert(g_video.tex_w);
 	assert(g_video.tex_h);
@@ -122,20 +631,64 @@ static void refresh_vertex_data() {
 	GLfloat *coords = g_texcoords;
 	coords[1] = coords[5] = (float)g_video.clip_h / g_video.tex_h;
 	coords[4] = coords[6] = (float)g_video.clip_w / g_video.tex_w;
+
+	if (g_video.program) {
+		glUseProgram(g_video.program);
+		glUniform2f(g_video.u_scale, coords[4], coords[1]);
+	}
 }
 
 
 static void resize_cb(GLFWwindow *win, int w, int h) {
 	glViewport(0, 0, w, h);
+	g_video.dirty = true;
+}
+
+
+// Hardware rendered cores get the context they asked for: a compatibility
+// one for plain OPENGL, at least their version of a core one otherwise.
+static void video_context_version(unsigned *major, unsigned *minor) {
+	*major = 3;
+	*minor = 3;
+
+	if (g_hw_render.context_type == RETRO_HW_CONTEXT_OPENGL_CORE &&
+			g_hw_render.version_major * 10 + g_hw_render.version_minor > *major * 10 + *minor) {
+		*major = g_hw_render.version_major;
+		*minor = g_hw_render.version_minor;
+	}
 }
 
 
 static void create_window(int width, int height) {
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+	unsigned major, minor;
+
+	video_context_version(&major, &minor);
+
 	glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
 
-	g_win = glfwCreateWindow(width, height, "nanoarch", NULL, NULL);
+	if (g_hw_render.context_type != RETRO_HW_CONTEXT_OPENGL) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, major);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+		g_win = glfwCreateWindow(width, height, "nanoarch", NULL, NULL);
+	}
+
+	g_video.core_profile = g_win != NULL;
+
+	if (!g_win && g_hw_render.context_type == RETRO_HW_CONTEXT_OPENGL_CORE)
+		die("Failed to create the GL %u.%u core context the core asked for", major, minor);
+
+	// Fall back to the fixed function pipeline on older drivers.
+	if (!g_win) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_ANY_PROFILE);
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_FALSE);
+
+		g_win = glfwCreateWindow(width, height, "nanoarch", NULL, NULL);
+	}
 
 	if (!g_win)
 		die("Failed to create window.");
@@ -148,11 +701,18 @@ static void create_window(int width, int height) {
 	if (glewInit() != GLEW_OK)
 		die("Failed to initialize glew");
 
-	glfwSwapInterval(1);
+	// glew probes extensions the old way, which core contexts reject.
+	glGetError();
+
+	if (g_hw_render.context_type && !(GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object))
+		die("Hardware rendering needs framebuffer objects");
+
+	glfwSwapInterval(g_pace.source == PACE_VSYNC);
 
 	printf("GLSL Version: %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
 
-	glEnable(GL_TEXTURE_2D);
+	if (!g_video.core_profile)
+		glEnable(GL_TEXTURE_2D);
 
 //	refresh_vertex_data();
 
@@ -160,6 +720,76 @@ static void create_window(int width, int height) {
 }
 
 
+static void video_init() {
+	if (!glfwInit())
+		die("Failed to initialize glfw");
+}
+
+
+static GLuint compile_shader(GLenum type, const char *defines, const char *source) {
+	const char *sources[] = { "#version 330 core\n", defines, source };
+	GLuint shader = glCreateShader(type);
+	GLint ok;
+	char log[1024];
+
+	glShaderSource(shader, array_len(sources), sources, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+
+	if (!ok) {
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		die("Failed to compile shader: %s", log);
+	}
+
+	return shader;
+}
+
+
+// Builds the program for the core's pixel format, and the quad it draws.
+static void create_program() {
+	static const GLfloat quad[] = {
+		-1.0f, -1.0f,  0.0f, 1.0f,
+		-1.0f,  1.0f,  0.0f, 0.0f,
+		 1.0f, -1.0f,  1.0f, 1.0f,
+		 1.0f,  1.0f,  1.0f, 0.0f,
+	};
+	const char *defines = g_pixel_format == RETRO_PIXEL_FORMAT_RGB565 ? "#define PACKED16\n#define RGB565\n" :
+			g_pixel_format == RETRO_PIXEL_FORMAT_0RGB1555 ? "#define PACKED16\n" : "";
+	GLuint vs = compile_shader(GL_VERTEX_SHADER, "", g_vertex_shader);
+	GLuint fs = compile_shader(GL_FRAGMENT_SHADER, defines, g_fragment_shader);
+	GLint ok;
+	char log[1024];
+
+	g_video.program = glCreateProgram();
+	glAttachShader(g_video.program, vs);
+	glAttachShader(g_video.program, fs);
+	glLinkProgram(g_video.program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+	glGetProgramiv(g_video.program, GL_LINK_STATUS, &ok);
+
+	if (!ok) {
+		glGetProgramInfoLog(g_video.program, sizeof(log), NULL, log);
+		die("Failed to link the video program: %s", log);
+	}
+
+	glUseProgram(g_video.program);
+	glUniform1i(glGetUniformLocation(g_video.program, "u_tex"), 0);
+	g_video.u_scale = glGetUniformLocation(g_video.program, "u_scale");
+
+	glGenVertexArrays(1, &g_video.vao);
+	glGenBuffers(1, &g_video.vbo);
+	glBindVertexArray(g_video.vao);
+	glBindBuffer(GL_ARRAY_BUFFER, g_video.vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (void *)0);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (void *)(2 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
 static void resize_to_aspect(double ratio, int sw, int sh, int *dw, int *dh) {
 	*dw = sw;
 	*dh = sh;
@@ -174,6 +804,111 @@ static void resize_to_aspect(double ratio, int sw, int sh, int *dw, int *dh) {
 }
 
 
+static uintptr_t video_hw_framebuffer() {
+	return g_video.fbo;
+}
+
+
+static retro_proc_address_t video_hw_proc_address(const char *sym) {
+	if (g_video.offscreen)
+		return (retro_proc_address_t)eglGetProcAddress(sym);
+
+	return (retro_proc_address_t)glfwGetProcAddress(sym);
+}
+
+
+// The context is only created by video_configure, after the core has loaded
+// its content, so this just checks that we can provide what it asks for.
+static bool video_set_hw_render(struct retro_hw_render_callback *hw) {
+	if (g_video.tex_id || (hw->context_type != RETRO_HW_CONTEXT_OPENGL && hw->context_type != RETRO_HW_CONTEXT_OPENGL_CORE))
+		return false;
+
+	hw->get_current_framebuffer = video_hw_framebuffer;
+	hw->get_proc_address = video_hw_proc_address;
+
+	return true;
+}
+
+
+// Creates the framebuffer the core renders into, as large as its frames can
+// get, with depth and stencil buffers if it wants them.
+static void video_hw_init(unsigned width, unsigned height) {
+	glGenFramebuffers(1, &g_video.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, g_video.fbo);
+
+	glGenRenderbuffers(1, &g_video.fbo_color);
+	glBindRenderbuffer(GL_RENDERBUFFER, g_video.fbo_color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, g_video.fbo_color);
+
+	// A stencil buffer on its own isn't supported by the callback.
+	if (g_hw_render.depth) {
+		glGenRenderbuffers(1, &g_video.fbo_depth);
+		glBindRenderbuffer(GL_RENDERBUFFER, g_video.fbo_depth);
+		glRenderbufferStorage(GL_RENDERBUFFER, g_hw_render.stencil ? GL_DEPTH24_STENCIL8 : GL_DEPTH_COMPONENT24,
+				width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, g_hw_render.stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
+				GL_RENDERBUFFER, g_video.fbo_depth);
+	}
+
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		die("Failed to create the framebuffer for hardware rendering");
+
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	g_hw_render.context_reset();
+}
+
+
+// Copies the core's last frame to the back buffer. Its first row is at the
+// top unless the core asked for GL's bottom left origin.
+static void video_hw_blit() {
+	int w = g_video.target_w, h = g_video.target_h;
+
+	if (!g_video.offscreen)
+		glfwGetFramebufferSize(g_win, &w, &h);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, g_video.fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_video.target);
+	glDisable(GL_SCISSOR_TEST);
+
+	if (g_hw_render.bottom_left_origin)
+		glBlitFramebuffer(0, 0, g_video.clip_w, g_video.clip_h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	else
+		glBlitFramebuffer(0, 0, g_video.clip_w, g_video.clip_h, 0, h, w, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	g_video.hw_blitted = true;
+}
+
+
+static void video_resize_target(int width, int height) {
+	if (!g_video.target) {
+		glGenFramebuffers(1, &g_video.target);
+		glGenRenderbuffers(1, &g_video.target_color);
+	}
+
+	glBindRenderbuffer(GL_RENDERBUFFER, g_video.target_color);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, g_video.target);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, g_video.target_color);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		die("Failed to create the offscreen framebuffer");
+
+	glViewport(0, 0, width, height);
+
+	g_video.target_w = width;
+	g_video.target_h = height;
+	g_video.dirty = true;
+}
+
+
 static void video_configure(const struct retro_game_geometry *geom) {
 	int nwidth, nheight;
 
@@ -182,7 +917,7 @@ static void video_configure(const struct retro_game_geometry *geom) {
 	nwidth *= g_scale;
 	nheight *= g_scale;
 
-	if (!g_win)
+	if (!g_win && !g_video.offscreen)
 		create_window(nwidth, nheight);
 
 	if (g_video.tex_id)
@@ -190,12 +925,46 @@ static void video_configure(const struct retro_game_geometry *geom) {
 
 	g_video.tex_id = 0;
 
-	if (!g_video.pixfmt)
-		g_video.pixfmt = GL_UNSIGNED_SHORT_5_5_5_1;
+	// The 16-bit formats go up as raw integers for the shader to unpack with
+	// a core context, and through the driver's conversion without one.
+	switch (g_pixel_format) {
+	case RETRO_PIXEL_FORMAT_XRGB8888:
+		g_video.internal_fmt = GL_RGBA8;
+		g_video.pixfmt = GL_UNSIGNED_INT_8_8_8_8_REV;
+		g_video.pixtype = GL_BGRA;
+		g_video.bpp = sizeof(uint32_t);
+		break;
+	case RETRO_PIXEL_FORMAT_RGB565:
+	default:
+		g_video.internal_fmt = GL_R16UI;
+		g_video.pixfmt = GL_UNSIGNED_SHORT;
+		g_video.pixtype = GL_RED_INTEGER;
+		g_video.bpp = sizeof(uint16_t);
+		break;
+	}
+
+	if (!g_video.core_profile && g_pixel_format != RETRO_PIXEL_FORMAT_XRGB8888) {
+		enum pixconv_isa isa;
+
+		g_video.convert = pixconv_get(g_pixel_format == RETRO_PIXEL_FORMAT_RGB565 ?
+				PIXCONV_RGB565_TO_XRGB8888 : PIXCONV_0RGB1555_TO_XRGB8888, &isa);
+		g_video.internal_fmt = GL_RGBA8;
+		g_video.pixfmt = GL_UNSIGNED_INT_8_8_8_8_REV;
+		g_video.pixtype = GL_BGRA;
+		g_video.bpp = sizeof(uint32_t);
+		fprintf(stderr, "Converting 16-bit frames with the %s kernel\n", pixconv_isa_names[isa]);
+	}
+
+	if (g_video.core_profile && !g_video.program)
+		create_program();
 
-	glfwSetWindowSize(g_win, nwidth, nheight);
-	glfwSetWindowAttrib(g_win, GLFW_RESIZABLE, GLFW_TRUE);
-	glfwSetWindowAspectRatio(g_win, nwidth, nheight);
+	if (g_video.offscreen) {
+		video_resize_target(nwidth, nheight);
+	} else {
+		glfwSetWindowSize(g_win, nwidth, nheight);
+		glfwSetWindowAttrib(g_win, GLFW_RESIZABLE, GLFW_TRUE);
+		glfwSetWindowAspectRatio(g_win, nwidth, nheight);
+	}
 
 	glGenTextures(1, &g_video.tex_id);
 
@@ -206,13 +975,13 @@ static void video_configure(const struct retro_game_geometry *geom) {
 
 	glBindTexture(GL_TEXTURE_2D, g_video.tex_id);
 
-//	glPixelStorei(GL_UNPACK_ALIGNMENT, s_video.pixfmt == GL_UNSIGNED_INT_8_8_8_8_REV ? 4 : 2);
-//	glPixelStorei(GL_UNPACK_ROW_LENGTH, s_video.pitch / s_video.bpp);
+	// Rows are as long as the core's pitch, which needn't be a multiple of 4.
+	glPixelStorei(GL_UNPACK_ALIGNMENT, g_video.bpp);
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, geom->max_width, geom->max_height, 0,
+	glTexImage2D(GL_TEXTURE_2D, 0, g_video.internal_fmt, geom->max_width, geom->max_height, 0,
 			g_video.pixtype, g_video.pixfmt, NULL);
 
 	glBindTexture(GL_TEXTURE_2D, 0);
@@ -223,314 +992,3228 @@ static void video_configure(const struct retro_game_geometry *geom) {
 	g_video.clip_h = geom->base_height;
 
 	refresh_vertex_data();
+
+	free(g_video.band_hash);
+	g_video.bands = (geom->max_height + VIDEO_BAND_ROWS - 1) / VIDEO_BAND_ROWS;
+	if (!(g_video.band_hash = calloc(g_video.bands, sizeof(*g_video.band_hash))))
+		die("Failed to allocate the frame hashes");
+	g_video.diff_valid = false;
+
+	if (g_video.pbo_enabled && !g_video.pbo[0]) {
+		if ((GLEW_VERSION_3_2 || (GLEW_ARB_pixel_buffer_object && GLEW_ARB_map_buffer_range && GLEW_ARB_sync)))
+			glGenBuffers(VIDEO_PBOS, g_video.pbo);
+		else
+			fprintf(stderr, "Pixel buffer objects or fences aren't supported, uploading directly\n");
+
+		g_video.pbo_enabled = g_video.pbo[0] != 0;
+	}
+
+	if (g_hw_render.context_type && !g_video.fbo)
+		video_hw_init(geom->max_width, geom->max_height);
 }
 
 
+// The GL formats are picked in video_configure, once the context is known.
 static bool video_set_pixel_format(unsigned format) {
 	if (g_video.tex_id)
 		die("Tried to change pixel format after initialization.");
 
-	switch (format) {
-	case RETRO_PIXEL_FORMAT_0RGB1555:
-		g_video.pixfmt = GL_UNSIGNED_SHORT_5_5_5_1;
-		g_video.pixtype = GL_BGRA;
-		g_video.bpp = sizeof(uint16_t);
-		break;
-	case RETRO_PIXEL_FORMAT_XRGB8888:
-		g_video.pixfmt = GL_UNSIGNED_INT_8_8_8_8_REV;
-		g_video.pixtype = GL_BGRA;
-		g_video.bpp = sizeof(uint32_t);
-		break;
-	case RETRO_PIXEL_FORMAT_RGB565:
-		g_video.pixfmt  = GL_UNSIGNED_SHORT_5_6_5;
-		g_video.pixtype = GL_RGB;
-		g_video.bpp = sizeof(uint16_t);
-		break;
-	default:
+	if (format > RETRO_PIXEL_FORMAT_RGB565)
 		die("Unknown pixel type %u", format);
-	}
 
 	return true;
 }
 
 
-static void video_refresh(const void *data, unsigned width, unsigned height, unsigned pitch) {
-	if (g_video.clip_w != width || g_video.clip_h != height) {
-		g_video.clip_h = height;
-		g_video.clip_w = width;
+static void video_upload_pbo(const void *data, unsigned y, unsigned width, unsigned height, unsigned pitch) {
+	unsigned i = g_video.pbo_next;
+	// The last row ends at the image's width, not at the pitch; reading a
+	// full pitch there would run past the end of the core's buffer.
+	GLsizeiptr size = (GLsizeiptr)pitch * (height - 1) + (GLsizeiptr)width * g_video.bpp;
+	bool idle = true;
+	void *dst;
 
-		refresh_vertex_data();
+	if (!height)
+		return;
+
+	g_video.pbo_next = (i + 1) % VIDEO_PBOS;
+
+	if (g_video.pbo_fence[i]) {
+		GLenum status = glClientWaitSync(g_video.pbo_fence[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+
+		if (status == GL_CONDITION_SATISFIED || status == GL_TIMEOUT_EXPIRED)
+			g_video.pbo_stalls++;
+
+		idle = status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+
+		glDeleteSync(g_video.pbo_fence[i]);
+		g_video.pbo_fence[i] = 0;
 	}
 
-	glBindTexture(GL_TEXTURE_2D, g_video.tex_id);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_video.pbo[i]);
 
-	if (pitch != g_video.pitch) {
-		g_video.pitch = pitch;
-		glPixelStorei(GL_UNPACK_ROW_LENGTH, g_video.pitch / g_video.bpp);
+	// If the GPU might still be reading the buffer, it's orphaned so the
+	// driver hands us fresh storage.
+	if (size > g_video.pbo_size[i] || !idle) {
+		if (size > g_video.pbo_size[i])
+			g_video.pbo_size[i] = size;
+
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, g_video.pbo_size[i], NULL, GL_STREAM_DRAW);
 	}
 
-	if (data) {
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
-						g_video.pixtype, g_video.pixfmt, data);
+	// Only a signaled fence makes an unsynchronized map safe.
+	dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | (idle ? GL_MAP_UNSYNCHRONIZED_BIT : 0));
+
+	if (dst) {
+		memcpy(dst, data, size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, width, height,
+						g_video.pixtype, g_video.pixfmt, NULL);
+		g_video.pbo_fence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		g_video.pbo_uploads++;
 	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (!dst)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, width, height,
+						g_video.pixtype, g_video.pixfmt, data);
 }
 
 
-static void video_render() {
-	glBindTexture(GL_TEXTURE_2D, g_video.tex_id);
+// A Fletcher-style checksum of a band of rows, which is much cheaper than a
+// real hash and still catches both changed and moved pixels.
+static uint64_t video_hash_band(const uint8_t *data, unsigned rows, size_t bytes, size_t pitch) {
+	uint64_t a = 1, b = 0;
+	unsigned y;
+	size_t x;
 
-	glEnableClientState(GL_VERTEX_ARRAY);
-	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	for (y = 0; y < rows; ++y, data += pitch) {
+		x = 0;
 
-	glVertexPointer(2, GL_FLOAT, 0, g_vertex);
-	glTexCoordPointer(2, GL_FLOAT, 0, g_texcoords);
+#ifdef __SSE2__
+		// Four 32-bit lanes of running sums, folded with distinct weights so
+		// pixels swapped between lanes still change the result.
+		__m128i s1 = _mm_setzero_si128(), s2 = _mm_setzero_si128();
+		uint32_t l1[4], l2[4];
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-}
+		for (; x + 16 <= bytes; x += 16) {
+			s1 = _mm_add_epi32(s1, _mm_loadu_si128((const __m128i *)(data + x)));
+			s2 = _mm_add_epi32(s2, s1);
+		}
 
+		_mm_storeu_si128((__m128i *)l1, s1);
+		_mm_storeu_si128((__m128i *)l2, s2);
+		a += (uint64_t)l1[0] + l1[1] + l1[2] + l1[3];
+		b += a + l2[0] + 3ull * l2[1] + 5ull * l2[2] + 7ull * l2[3] + l1[1] + 2ull * l1[2] + 3ull * l1[3];
+#endif
 
-static void video_deinit() {
-	if (g_video.tex_id)
-		glDeleteTextures(1, &g_video.tex_id);
+		for (; x + 4 <= bytes; x += 4) {
+			uint32_t v;
 
-	g_video.tex_id = 0;
+			memcpy(&v, data + x, sizeof(v));
+			a += v;
+			b += a;
+		}
+
+		for (; x < bytes; ++x) {
+			a += data[x];
+			b += a;
+		}
+	}
+
+	return a ^ (b << 32 | b >> 32);
 }
 
 
-static void audio_init(int frequency) {
-	int err;
+// Finds the rows that changed since the last frame, as [*first, *last).
+static void video_diff(const uint8_t *data, unsigned width, unsigned height, size_t pitch,
+		unsigned *first, unsigned *last) {
+	unsigned bands = (height + VIDEO_BAND_ROWS - 1) / VIDEO_BAND_ROWS;
+	unsigned i, rows, dirty_first = bands, dirty_last = 0;
+	uint64_t hash;
 
-	if ((err = snd_pcm_open(&g_pcm, "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0)
-		die("Failed to open playback device: %s", snd_strerror(err));
+	for (i = 0; i < bands; ++i) {
+		rows = i == bands - 1 ? height - i * VIDEO_BAND_ROWS : VIDEO_BAND_ROWS;
+		hash = video_hash_band(data + i * VIDEO_BAND_ROWS * pitch, rows, (size_t)width * g_video.bpp, pitch);
+
+		if (!g_video.diff_valid || hash != g_video.band_hash[i]) {
+			g_video.band_hash[i] = hash;
+			if (dirty_first == bands)
+				dirty_first = i;
+			dirty_last = i + 1;
+		}
+	}
 
-	err = snd_pcm_set_params(g_pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 2, frequency, 1, 64 * 1000);
+	g_video.diff_valid = true;
+	g_video.bands_total += bands;
 
-	if (err < 0)
-		die("Failed to configure playback device: %s", snd_strerror(err));
+	if (dirty_first == bands) {
+		*first = *last = 0;
+		return;
+	}
+
+	g_video.bands_uploaded += dirty_last - dirty_first;
+	*first = dirty_first * VIDEO_BAND_ROWS;
+	*last = dirty_last * VIDEO_BAND_ROWS < height ? dirty_last * VIDEO_BAND_ROWS : height;
 }
 
 
-static void audio_deinit() {
-	snd_pcm_close(g_pcm);
+// Persistent buffers can't be orphaned, so this keeps waiting until the GPU
+// is really done with them.
+static void video_wait_fence(GLsync *fence) {
+	if (!*fence)
+		return;
+
+	while (glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) == GL_TIMEOUT_EXPIRED);
+	glDeleteSync(*fence);
+	*fence = 0;
 }
 
 
-static size_t audio_write(const void *buf, unsigned frames) {
-	if (!g_pcm)
-		return 0;
+static void video_framebuffer_init() {
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	size_t pitch = framebuffer_pitch(g_video.tex_w);
+	unsigned i;
 
-	int written = snd_pcm_writei(g_pcm, buf, frames);
+	g_video.fb_size = pitch * g_video.tex_h;
+	glGenBuffers(VIDEO_PBOS, g_video.fb_buf);
 
-	if (written < 0) {
-		printf("Alsa warning/error #%i: ", -written);
-		snd_pcm_recover(g_pcm, written, 0);
+	for (i = 0; i < VIDEO_PBOS; ++i) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_video.fb_buf[i]);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, g_video.fb_size, NULL, flags);
 
-		return 0;
+		if (!(g_video.fb_map[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, g_video.fb_size, flags)))
+			die("Failed to map the software framebuffer");
 	}
 
-	return written;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 
-static void core_log(enum retro_log_level level, const char *fmt, ...) {
-	char buffer[4096] = {0};
-	static const char * levelstr[] = { "dbg", "inf", "wrn", "err" };
-	va_list va;
+// Lends the core the next buffer of the ring once its last upload is done.
+// Reading from write-combined memory is slow, so cores that want to read
+// render into their own memory instead.
+static bool video_get_framebuffer(struct retro_framebuffer *fb) {
+	size_t pitch = framebuffer_pitch(fb->width);
+	unsigned i;
 
-	va_start(va, fmt);
-	vsnprintf(buffer, sizeof(buffer), fmt, va);
-	va_end(va);
+	if (!g_video.pbo_enabled || !(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) ||
+			fb->access_flags & RETRO_MEMORY_ACCESS_READ || g_video.convert)
+		return false;
 
-	if (level == 0)
-		return;
+	if (!g_video.fb_buf[0])
+		video_framebuffer_init();
 
-	fprintf(stderr, "[%s] %s", levelstr[level], buffer);
-	fflush(stderr);
+	if (pitch * fb->height > g_video.fb_size)
+		return false;
 
-	if (level == RETRO_LOG_ERROR)
-		exit(EXIT_FAILURE);
+	i = g_video.fb_next;
+	g_video.fb_next = (i + 1) % VIDEO_PBOS;
+	g_video.fb_current = i;
+	video_wait_fence(&g_video.fb_fence[i]);
+
+	fb->data = g_video.fb_map[i];
+	fb->pitch = pitch;
+	fb->format = g_pixel_format;
+	fb->memory_flags = 0;
+
+	return true;
 }
 
 
-static bool core_environment(unsigned cmd, void *data) {
-	bool *bval;
+static void video_refresh(const void *data, unsigned width, unsigned height, unsigned pitch) {
+	unsigned first = 0, last = height;
 
-	switch (cmd) {
-	case RETRO_ENVIRONMENT_GET_LOG_INTERFACE: {
-		struct retro_log_callback *cb = (struct retro_log_callback *)data;
-		cb->log = core_log;
-		break;
+	if (g_hw_render.context_type) {
+		// The core owns the GL state between frames, so the texture path
+		// can't be trusted to work for software frames.
+		if (data != RETRO_HW_FRAME_BUFFER_VALID)
+			return;
+
+		g_video.clip_w = width;
+		g_video.clip_h = height;
+		g_video.dirty = true;
+		video_hw_blit();
+		return;
+	}
+
+	if (data && g_video.convert) {
+		size_t conv_pitch = (size_t)width * sizeof(uint32_t);
+
+		if (g_video.conv_size < conv_pitch * height) {
+			free(g_video.conv);
+			if (!(g_video.conv = malloc(conv_pitch * height)))
+				die("Failed to allocate the conversion buffer");
+			g_video.conv_size = conv_pitch * height;
+		}
+
+		g_video.convert(g_video.conv, conv_pitch, data, pitch, width, height);
+		data = g_video.conv;
+		pitch = conv_pitch;
+	}
+
+	if (g_video.clip_w != width || g_video.clip_h != height) {
+		g_video.clip_h = height;
+		g_video.clip_w = width;
+		g_video.diff_valid = false;
+		g_video.dirty = true;
+
+		refresh_vertex_data();
+	}
+
+	glBindTexture(GL_TEXTURE_2D, g_video.tex_id);
+
+	if (pitch != g_video.pitch) {
+		g_video.pitch = pitch;
+		g_video.diff_valid = false;
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, g_video.pitch / g_video.bpp);
+	}
+
+	// Hashing write-combined memory would be slow, and frames rendered into
+	// our own buffers don't need a copy anyway.
+	if (data && g_video.diff_enabled && !(g_video.fb_buf[0] && data == g_video.fb_map[g_video.fb_current])) {
+		video_diff(data, width, height, pitch, &first, &last);
+		if (first == last)
+			return;
+	} else {
+		g_video.diff_valid = false;
+	}
+
+	if (data)
+		g_video.dirty = true;
+
+	if (data && g_video.fb_buf[0] && data == g_video.fb_map[g_video.fb_current]) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_video.fb_buf[g_video.fb_current]);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+						g_video.pixtype, g_video.pixfmt, NULL);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		g_video.fb_fence[g_video.fb_current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		g_video.fb_uploads++;
+	} else if (data && g_video.pbo_enabled) {
+		video_upload_pbo((const uint8_t *)data + first * pitch, first, width, last - first, pitch);
+	} else if (data) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, width, last - first,
+						g_video.pixtype, g_video.pixfmt, (const uint8_t *)data + first * pitch);
+	}
+}
+
+
+// Offscreen there's nothing to swap, the frame just has to be submitted.
+static void video_swap() {
+	if (g_video.offscreen)
+		glFlush();
+	else
+		glfwSwapBuffers(g_win);
+}
+
+
+static void video_render() {
+	if (g_video.skip_present && !g_video.dirty) {
+		g_video.presents_skipped++;
+		return;
+	}
+
+	g_video.dirty = false;
+
+	// Repeated frames are blitted again, as swapping left the back buffer
+	// undefined.
+	if (g_hw_render.context_type) {
+		if (!g_video.hw_blitted)
+			video_hw_blit();
+
+		g_video.hw_blitted = false;
+		video_swap();
+		return;
+	}
+
+	if (g_video.offscreen)
+		glBindFramebuffer(GL_FRAMEBUFFER, g_video.target);
+
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	glBindTexture(GL_TEXTURE_2D, g_video.tex_id);
+
+	if (g_video.program) {
+		glBindVertexArray(g_video.vao);
+	} else {
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+		glVertexPointer(2, GL_FLOAT, 0, g_vertex);
+		glTexCoordPointer(2, GL_FLOAT, 0, g_texcoords);
+	}
+
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	video_swap();
+}
+
+
+// Only the offscreen target still holds the last frame once it's presented,
+// so that's the only one read back.
+static bool video_screenshot(const char *path) {
+	int w = g_video.target_w, h = g_video.target_h, y;
+	uint8_t *pixels;
+	FILE *file;
+
+	if (!g_video.offscreen || !(pixels = malloc((size_t)w * h * 3)))
+		return false;
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, g_video.target);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+	if (!(file = fopen(path, "wb"))) {
+		free(pixels);
+		return false;
+	}
+
+	// GL's rows go bottom up.
+	fprintf(file, "P6\n%d %d\n255\n", w, h);
+	for (y = h - 1; y >= 0; --y)
+		fwrite(pixels + (size_t)y * w * 3, 3, w, file);
+
+	free(pixels);
+
+	return !fclose(file);
+}
+
+
+static void video_set_vsync(bool enabled) {
+	glfwSwapInterval(enabled && g_pace.source == PACE_VSYNC);
+}
+
+
+static double video_refresh_rate() {
+	const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+
+	return mode ? mode->refreshRate : 0;
+}
+
+
+static void video_deinit() {
+	unsigned i;
+
+	if (g_video.bands_total)
+		fprintf(stderr, "Frame diff: uploaded %.1f%% of row bands, skipped %llu presents\n",
+			100.0 * g_video.bands_uploaded / g_video.bands_total, (unsigned long long)g_video.presents_skipped);
+
+	free(g_video.band_hash);
+	g_video.band_hash = NULL;
+
+	free(g_video.conv);
+	g_video.conv = NULL;
+	g_video.conv_size = 0;
+
+	if (g_video.pbo_uploads)
+		fprintf(stderr, "PBO uploads: %llu, %llu waited for the GPU\n",
+			(unsigned long long)g_video.pbo_uploads, (unsigned long long)g_video.pbo_stalls);
+
+	for (i = 0; i < VIDEO_PBOS; ++i) {
+		if (g_video.pbo_fence[i])
+			glDeleteSync(g_video.pbo_fence[i]);
+		g_video.pbo_fence[i] = 0;
+	}
+
+	if (g_video.pbo[0])
+		glDeleteBuffers(VIDEO_PBOS, g_video.pbo);
+
+	memset(g_video.pbo, 0, sizeof(g_video.pbo));
+
+	if (g_video.fb_uploads)
+		fprintf(stderr, "Zero-copy uploads from the software framebuffer: %llu\n", (unsigned long long)g_video.fb_uploads);
+
+	for (i = 0; i < VIDEO_PBOS; ++i) {
+		if (g_video.fb_fence[i])
+			glDeleteSync(g_video.fb_fence[i]);
+		g_video.fb_fence[i] = 0;
+
+		if (g_video.fb_map[i]) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_video.fb_buf[i]);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		g_video.fb_map[i] = NULL;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (g_video.fb_buf[0])
+		glDeleteBuffers(VIDEO_PBOS, g_video.fb_buf);
+
+	memset(g_video.fb_buf, 0, sizeof(g_video.fb_buf));
+
+	if (g_video.tex_id)
+		glDeleteTextures(1, &g_video.tex_id);
+
+	g_video.tex_id = 0;
+
+	if (g_video.program) {
+		glDeleteProgram(g_video.program);
+		glDeleteVertexArrays(1, &g_video.vao);
+		glDeleteBuffers(1, &g_video.vbo);
+	}
+
+	g_video.program = g_video.vao = g_video.vbo = 0;
+
+	if (g_video.fbo) {
+		glDeleteFramebuffers(1, &g_video.fbo);
+		glDeleteRenderbuffers(1, &g_video.fbo_color);
+		if (g_video.fbo_depth)
+			glDeleteRenderbuffers(1, &g_video.fbo_depth);
+	}
+
+	g_video.fbo = g_video.fbo_color = g_video.fbo_depth = 0;
+
+	if (g_video.target) {
+		glDeleteFramebuffers(1, &g_video.target);
+		glDeleteRenderbuffers(1, &g_video.target_color);
+	}
+
+	g_video.target = g_video.target_color = 0;
+
+	if (!g_video.offscreen)
+		glfwTerminate();
+}
+
+
+static const struct video_backend video_gl = {
+	"gl",
+	video_init,
+	video_configure,
+	video_set_pixel_format,
+	video_set_hw_render,
+	video_refresh,
+	video_render,
+	video_set_vsync,
+	video_refresh_rate,
+	video_get_framebuffer,
+	video_screenshot,
+	video_deinit,
+};
+
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+// Renders offscreen through EGL on Mesa's surfaceless platform, so machines
+// without a display server take the same upload and render path as the gl
+// backend. Nothing is read back unless a screenshot is asked for.
+static struct {
+	EGLDisplay display;
+	EGLContext context;
+} g_egl = { EGL_NO_DISPLAY, EGL_NO_CONTEXT };
+
+
+static void egl_video_init() {
+	EGLint major, minor;
+
+	g_video.offscreen = true;
+	g_egl.display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+	if (g_egl.display == EGL_NO_DISPLAY || !eglInitialize(g_egl.display, &major, &minor))
+		die("Failed to initialize a surfaceless EGL display");
+
+	if (!eglBindAPI(EGL_OPENGL_API))
+		die("EGL can't create OpenGL contexts");
+}
+
+
+// Like create_window, without the window.
+static void egl_create_context() {
+	static const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	static const EGLint legacy_attribs[] = { EGL_NONE };
+	EGLint core_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_CONTEXT_OPENGL_FORWARD_COMPATIBLE, EGL_TRUE,
+		EGL_NONE
+	};
+	unsigned major, minor;
+	EGLConfig config;
+	EGLint count;
+
+	video_context_version(&major, &minor);
+	core_attribs[1] = major;
+	core_attribs[3] = minor;
+
+	if (!eglChooseConfig(g_egl.display, config_attribs, &config, 1, &count) || !count)
+		die("No EGL config supports OpenGL");
+
+	if (g_hw_render.context_type != RETRO_HW_CONTEXT_OPENGL)
+		g_egl.context = eglCreateContext(g_egl.display, config, EGL_NO_CONTEXT, core_attribs);
+
+	g_video.core_profile = g_egl.context != EGL_NO_CONTEXT;
+
+	if (!g_video.core_profile && g_hw_render.context_type == RETRO_HW_CONTEXT_OPENGL_CORE)
+		die("Failed to create the GL %u.%u core context the core asked for", major, minor);
+
+	if (!g_video.core_profile)
+		g_egl.context = eglCreateContext(g_egl.display, config, EGL_NO_CONTEXT, legacy_attribs);
+
+	if (g_egl.context == EGL_NO_CONTEXT ||
+			!eglMakeCurrent(g_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, g_egl.context))
+		die("Failed to create an EGL context");
+
+	// glewInit would go looking for GLX as well.
+	glewExperimental = GL_TRUE;
+	if (glewContextInit() != GLEW_OK)
+		die("Failed to initialize glew");
+
+	glGetError();
+
+	if (!(GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object))
+		die("Offscreen rendering needs framebuffer objects");
+
+	printf("GLSL Version: %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+	if (!g_video.core_profile)
+		glEnable(GL_TEXTURE_2D);
+}
+
+
+static void egl_video_configure(const struct retro_game_geometry *geom) {
+	if (g_egl.context == EGL_NO_CONTEXT)
+		egl_create_context();
+
+	video_configure(geom);
+}
+
+
+static void egl_video_set_vsync(bool enabled) {}
+static double egl_video_refresh_rate() { return 0; }
+
+static void egl_video_deinit() {
+	if (g_egl.context != EGL_NO_CONTEXT)
+		video_deinit();
+
+	if (g_egl.display != EGL_NO_DISPLAY) {
+		eglMakeCurrent(g_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (g_egl.context != EGL_NO_CONTEXT)
+			eglDestroyContext(g_egl.display, g_egl.context);
+		eglTerminate(g_egl.display);
+	}
+
+	g_egl.context = EGL_NO_CONTEXT;
+	g_egl.display = EGL_NO_DISPLAY;
+}
+
+static const struct video_backend video_egl = {
+	"egl",
+	egl_video_init,
+	egl_video_configure,
+	video_set_pixel_format,
+	video_set_hw_render,
+	video_refresh,
+	video_render,
+	egl_video_set_vsync,
+	egl_video_refresh_rate,
+	video_get_framebuffer,
+	video_screenshot,
+	egl_video_deinit,
+};
+
+
+static void null_video_init() {}
+static void null_video_configure(const struct retro_game_geometry *geom) {}
+static bool null_video_set_pixel_format(unsigned format) { return format <= RETRO_PIXEL_FORMAT_RGB565; }
+static bool null_video_set_hw_render(struct retro_hw_render_callback *hw) { return false; }
+static void null_video_refresh(const void *data, unsigned width, unsigned height, unsigned pitch) {}
+static void null_video_render() {}
+static void null_video_set_vsync(bool enabled) {}
+static double null_video_refresh_rate() { return 0; }
+static bool null_video_screenshot(const char *path) { return false; }
+// Headless, cores get plain aligned memory that's never read back.
+static struct {
+	void *data;
+	size_t size;
+} g_null_fb = {0};
+
+static bool null_video_get_framebuffer(struct retro_framebuffer *fb) {
+	size_t pitch = framebuffer_pitch(fb->width);
+
+	if (g_null_fb.size < pitch * fb->height) {
+		free(g_null_fb.data);
+		if (posix_memalign(&g_null_fb.data, FRAMEBUFFER_ALIGN, pitch * fb->height))
+			die("Failed to allocate the software framebuffer");
+		g_null_fb.size = pitch * fb->height;
+	}
+
+	fb->data = g_null_fb.data;
+	fb->pitch = pitch;
+	fb->format = g_pixel_format;
+	fb->memory_flags = RETRO_MEMORY_TYPE_CACHED;
+
+	return true;
+}
+
+static void null_video_deinit() {
+	free(g_null_fb.data);
+	g_null_fb.data = NULL;
+	g_null_fb.size = 0;
+}
+
+static const struct video_backend video_null = {
+	"null",
+	null_video_init,
+	null_video_configure,
+	null_video_set_pixel_format,
+	null_video_set_hw_render,
+	null_video_refresh,
+	null_video_render,
+	null_video_set_vsync,
+	null_video_refresh_rate,
+	null_video_get_framebuffer,
+	null_video_screenshot,
+	null_video_deinit,
+};
+
+
+static void audio_ring_init(struct audio_ring *r, size_t frames) {
+	r->capacity = 1;
+	while (r->capacity < frames)
+		r->capacity <<= 1;
+
+	if (!(r->data = malloc(r->capacity * 2 * sizeof(int16_t))))
+		die("Failed to allocate the audio ring");
+
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+}
+
+
+static void audio_ring_deinit(struct audio_ring *r) {
+	free(r->data);
+	r->data = NULL;
+}
+
+
+static size_t audio_ring_fill(struct audio_ring *r) {
+	return atomic_load_explicit(&r->head, memory_order_acquire) -
+		atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+
+// Producer side, returns how many frames fit.
+static size_t audio_ring_write(struct audio_ring *r, const int16_t *data, size_t frames) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	size_t pos = head & (r->capacity - 1);
+	size_t first;
+
+	if (frames > r->capacity - (head - tail))
+		frames = r->capacity - (head - tail);
+
+	first = r->capacity - pos < frames ? r->capacity - pos : frames;
+	memcpy(r->data + pos * 2, data, first * 2 * sizeof(int16_t));
+	memcpy(r->data, data + first * 2, (frames - first) * 2 * sizeof(int16_t));
+
+	atomic_store_explicit(&r->head, head + frames, memory_order_release);
+	return frames;
+}
+
+
+// Consumer side: the readable frames that are contiguous in memory, so they
+// can be handed to the device without another copy.
+static size_t audio_ring_peek(struct audio_ring *r, const int16_t **data) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	size_t pos = tail & (r->capacity - 1);
+
+	*data = r->data + pos * 2;
+	return head - tail < r->capacity - pos ? head - tail : r->capacity - pos;
+}
+
+
+static void audio_ring_consume(struct audio_ring *r, size_t frames) {
+	atomic_fetch_add_explicit(&r->tail, frames, memory_order_release);
+}
+
+
+static bool audio_open(int frequency, snd_pcm_access_t access) {
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	snd_pcm_uframes_t period_size;
+	unsigned rate = frequency;
+	unsigned buffer_us = g_pcm_buffer_us;
+	unsigned period_us = g_pcm_period_us ? g_pcm_period_us : g_pcm_buffer_us / 4;
+	int err;
+
+	if ((err = snd_pcm_open(&g_pcm, "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+		fprintf(stderr, "Failed to open playback device: %s\n", snd_strerror(err));
+		g_pcm = NULL;
+		return false;
+	}
+
+	snd_pcm_hw_params_malloc(&hw);
+	snd_pcm_hw_params_any(g_pcm, hw);
+
+	if ((err = snd_pcm_hw_params_set_access(g_pcm, hw, access)) < 0 ||
+			(err = snd_pcm_hw_params_set_format(g_pcm, hw, SND_PCM_FORMAT_S16)) < 0 ||
+			(err = snd_pcm_hw_params_set_channels(g_pcm, hw, 2)) < 0 ||
+			(err = snd_pcm_hw_params_set_rate_resample(g_pcm, hw, 1)) < 0 ||
+			(err = snd_pcm_hw_params_set_rate_near(g_pcm, hw, &rate, NULL)) < 0 ||
+			(err = snd_pcm_hw_params_set_buffer_time_near(g_pcm, hw, &buffer_us, NULL)) < 0 ||
+			(err = snd_pcm_hw_params_set_period_time_near(g_pcm, hw, &period_us, NULL)) < 0 ||
+			(err = snd_pcm_hw_params(g_pcm, hw)) < 0)
+		die("Failed to configure playback device: %s", snd_strerror(err));
+
+	snd_pcm_hw_params_get_buffer_size(hw, &g_pcm_buffer_size);
+	snd_pcm_hw_params_get_period_size(hw, &period_size, NULL);
+	snd_pcm_hw_params_free(hw);
+
+	// Start playing as soon as a period is queued and wake up a period at a time.
+	snd_pcm_sw_params_malloc(&sw);
+	snd_pcm_sw_params_current(g_pcm, sw);
+	snd_pcm_sw_params_set_start_threshold(g_pcm, sw, period_size);
+	snd_pcm_sw_params_set_avail_min(g_pcm, sw, period_size);
+
+	if ((err = snd_pcm_sw_params(g_pcm, sw)) < 0)
+		die("Failed to configure playback device: %s", snd_strerror(err));
+
+	snd_pcm_sw_params_free(sw);
+
+	if (rate != (unsigned)frequency)
+		fprintf(stderr, "Playing %u Hz audio at %u Hz\n", frequency, rate);
+
+	return true;
+}
+
+
+static bool audio_init(int frequency) {
+	return audio_open(frequency, SND_PCM_ACCESS_RW_INTERLEAVED);
+}
+
+
+static void audio_deinit() {
+	if (g_pcm)
+		snd_pcm_close(g_pcm);
+}
+
+
+static size_t audio_write(const void *buf, unsigned frames) {
+	if (!g_pcm)
+		return 0;
+
+	int written = snd_pcm_writei(g_pcm, buf, frames);
+
+	if (written < 0) {
+		if (written == -EPIPE)
+			atomic_fetch_add_explicit(&g_audio_stats.xruns, 1, memory_order_relaxed);
+
+		printf("Alsa warning/error #%i: ", -written);
+		snd_pcm_recover(g_pcm, written, 0);
+
+		return 0;
+	}
+
+	return written;
+}
+
+
+static bool audio_wait(int timeout_ms) {
+	int err = snd_pcm_wait(g_pcm, timeout_ms);
+
+	if (err < 0)
+		snd_pcm_recover(g_pcm, err, 1);
+
+	return err != 0;
+}
+
+
+static double audio_fill() {
+	snd_pcm_sframes_t avail = snd_pcm_avail(g_pcm);
+
+	if (avail < 0 || !g_pcm_buffer_size)
+		return -1;
+
+	return 1.0 - (double)avail / g_pcm_buffer_size;
+}
+
+
+static const struct audio_backend audio_alsa = {
+	"alsa",
+	audio_init,
+	audio_write,
+	audio_wait,
+	audio_fill,
+	audio_deinit,
+};
+
+
+static bool mmap_audio_init(int frequency) {
+	return audio_open(frequency, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+}
+
+
+// Copies straight into the device's ring buffer, waiting for room as the
+// blocking snd_pcm_writei would.
+static size_t mmap_audio_write(const void *buf, unsigned frames) {
+	const int16_t *src = buf;
+	unsigned done = 0;
+
+	while (done < frames) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset, n;
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(g_pcm), committed;
+		int err;
+
+		if (avail < 0) {
+			if (avail == -EPIPE)
+				atomic_fetch_add_explicit(&g_audio_stats.xruns, 1, memory_order_relaxed);
+
+			if (snd_pcm_recover(g_pcm, avail, 1) < 0)
+				return done;
+
+			continue;
+		}
+
+		if (!avail) {
+			// A full buffer that hasn't started would never drain.
+			if (snd_pcm_state(g_pcm) == SND_PCM_STATE_PREPARED)
+				snd_pcm_start(g_pcm);
+
+			snd_pcm_wait(g_pcm, 100);
+			continue;
+		}
+
+		n = frames - done < (snd_pcm_uframes_t)avail ? frames - done : avail;
+
+		if ((err = snd_pcm_mmap_begin(g_pcm, &areas, &offset, &n)) < 0) {
+			if (snd_pcm_recover(g_pcm, err, 1) < 0)
+				return done;
+
+			continue;
+		}
+
+		// Interleaved S16 stereo: one area whose step is a whole frame.
+		memcpy((uint8_t *)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8),
+			src + done * 2, n * 2 * sizeof(int16_t));
+
+		committed = snd_pcm_mmap_commit(g_pcm, offset, n);
+
+		if (committed < 0 || (snd_pcm_uframes_t)committed != n) {
+			if (snd_pcm_recover(g_pcm, committed < 0 ? committed : -EPIPE, 1) < 0)
+				return done;
+
+			continue;
+		}
+
+		done += n;
+	}
+
+	return done;
+}
+
+
+static const struct audio_backend audio_alsa_mmap = {
+	"alsa-mmap",
+	mmap_audio_init,
+	mmap_audio_write,
+	audio_wait,
+	audio_fill,
+	audio_deinit,
+};
+
+
+static atomic_ulong g_null_audio_frames = 0;
+static int g_null_audio_rate = 0;
+
+static bool null_audio_init(int frequency) {
+	g_null_audio_rate = frequency;
+	return true;
+}
+
+
+// Discards the samples, but keeps count for headless runs and benchmarks.
+static size_t null_audio_write(const void *buf, unsigned frames) {
+	atomic_fetch_add_explicit(&g_null_audio_frames, frames, memory_order_relaxed);
+	return frames;
+}
+
+
+static void null_audio_deinit() {
+	unsigned long frames = atomic_load(&g_null_audio_frames);
+
+	if (frames && g_null_audio_rate > 0)
+		fprintf(stderr, "Null audio: discarded %lu frames (%.2f s)\n",
+			frames, (double)frames / g_null_audio_rate);
+}
+
+
+// There's no device to drain, so ask for audio at roughly a period's pace.
+static bool null_audio_wait(int timeout_ms) {
+	struct timespec ts = { 0, 5000000 };
+	nanosleep(&ts, NULL);
+	return true;
+}
+
+static double null_audio_fill() { return -1; }
+
+static const struct audio_backend audio_null = {
+	"null",
+	null_audio_init,
+	null_audio_write,
+	null_audio_wait,
+	null_audio_fill,
+	null_audio_deinit,
+};
+
+
+// Streams the audio to a WAV or raw PCM file. Samples are queued in a ring
+// so the file system never stalls the emulation, and a background thread
+// writes them out through a large stdio buffer. Nothing is dropped: a full
+// ring blocks the producer until the writer catches up.
+#define FILE_AUDIO_BUFFER (1 << 20)
+
+static struct {
+	const char *path;
+	FILE *file;
+	bool wav;
+	int rate;
+	struct audio_ring ring;
+	pthread_t thread;
+	atomic_bool quit;
+	uint64_t frames;
+} g_audio_file = {0};
+
+
+static void file_audio_write_header(uint32_t data_bytes) {
+	uint8_t h[44] = { 'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E',
+		'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 2, 0 };
+	uint32_t rate = g_audio_file.rate, byte_rate = rate * 4, riff = data_bytes + 36;
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		h[4 + i] = riff >> (i * 8);
+		h[24 + i] = rate >> (i * 8);
+		h[28 + i] = byte_rate >> (i * 8);
+		h[40 + i] = data_bytes >> (i * 8);
+	}
+
+	h[32] = 4;   // block align
+	h[34] = 16;  // bits per sample
+	memcpy(h + 36, "data", 4);
+
+	fwrite(h, 1, sizeof(h), g_audio_file.file);
+}
+
+
+static void *file_audio_thread(void *arg) {
+	struct audio_ring *r = &g_audio_file.ring;
+
+	for (;;) {
+		bool quit = atomic_load(&g_audio_file.quit);
+		const int16_t *data;
+		size_t frames = audio_ring_peek(r, &data);
+
+		if (frames) {
+			fwrite(data, 2 * sizeof(int16_t), frames, g_audio_file.file);
+			audio_ring_consume(r, frames);
+			g_audio_file.frames += frames;
+			continue;
+		}
+
+		if (quit)
+			break;
+
+		struct timespec ts = { 0, 2000000 };
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+
+static bool file_audio_init(int frequency) {
+	const char *ext;
+
+	if (!g_audio_file.path)
+		die("The file audio backend needs --audio-file <path>");
+
+	if (!(g_audio_file.file = fopen(g_audio_file.path, "wb")))
+		die("Failed to open '%s': %s", g_audio_file.path, strerror(errno));
+
+	setvbuf(g_audio_file.file, NULL, _IOFBF, FILE_AUDIO_BUFFER);
+
+	ext = strrchr(g_audio_file.path, '.');
+	g_audio_file.wav = ext && !strcasecmp(ext, ".wav");
+	g_audio_file.rate = frequency;
+
+	if (g_audio_file.wav)
+		file_audio_write_header(0);
+
+	// About a second of audio.
+	audio_ring_init(&g_audio_file.ring, frequency > 0 ? frequency : 48000);
+
+	if (pthread_create(&g_audio_file.thread, NULL, file_audio_thread, NULL))
+		die("Failed to create the audio file thread");
+
+	return true;
+}
+
+
+static size_t file_audio_write(const void *buf, unsigned frames) {
+	const int16_t *data = buf;
+	size_t done = 0;
+
+	while ((done += audio_ring_write(&g_audio_file.ring, data + done * 2, frames - done)) < frames) {
+		struct timespec ts = { 0, 1000000 };
+		nanosleep(&ts, NULL);
+	}
+
+	return frames;
+}
+
+
+static bool file_audio_wait(int timeout_ms) {
+	struct timespec ts = { 0, 1000000 };
+
+	for (; timeout_ms > 0; --timeout_ms) {
+		if (audio_ring_fill(&g_audio_file.ring) < g_audio_file.ring.capacity / 2)
+			return true;
+
+		nanosleep(&ts, NULL);
+	}
+
+	return false;
+}
+
+
+static double file_audio_fill() { return -1; }
+
+
+static void file_audio_deinit() {
+	if (!g_audio_file.file)
+		return;
+
+	atomic_store(&g_audio_file.quit, true);
+	pthread_join(g_audio_file.thread, NULL);
+
+	if (g_audio_file.wav) {
+		rewind(g_audio_file.file);
+		file_audio_write_header(g_audio_file.frames * 4);
+	}
+
+	fclose(g_audio_file.file);
+	g_audio_file.file = NULL;
+	audio_ring_deinit(&g_audio_file.ring);
+
+	fprintf(stderr, "Wrote %llu audio frames to '%s'\n",
+		(unsigned long long)g_audio_file.frames, g_audio_file.path);
+}
+
+
+static const struct audio_backend audio_file = {
+	"file",
+	file_audio_init,
+	file_audio_write,
+	file_audio_wait,
+	file_audio_fill,
+	file_audio_deinit,
+};
+
+
+static void latency_event(unsigned port, unsigned buttons, uint64_t time, enum latency_stage stage) {
+	struct latency_event *ev = NULL, *oldest = NULL;
+	int i;
+
+	if (!g_latency.enabled || !buttons)
+		return;
+
+	for (i = 0; i < LATENCY_EVENTS && !ev; ++i) {
+		if (g_latency.events[i].stage == LATENCY_FREE)
+			ev = &g_latency.events[i];
+		else if (g_latency.events[i].stage < LATENCY_OBSERVED &&
+				(!oldest || g_latency.events[i].time[0] < oldest->time[0]))
+			oldest = &g_latency.events[i];
+	}
+
+	// Changes to buttons the core never reads pile up, make room for new ones.
+	// Events it did read are only waiting for a present and are kept.
+	if (!ev && oldest) {
+		ev = oldest;
+		g_latency.dropped++;
+		g_latency.pending--;
+	}
+
+	if (!ev) {
+		g_latency.untracked++;
+		return;
+	}
+
+	ev->stage = stage;
+	ev->port = port;
+	ev->buttons = buttons;
+	ev->time[0] = time;
+	g_latency.pending++;
+}
+
+
+// Moves every event at one stage to the next, or only those matching the
+// buttons the core asked about when it reads input.
+static void latency_advance(enum latency_stage from, unsigned port, unsigned buttons) {
+	uint64_t now = 0;
+	int i, j;
+
+	if (!g_latency.pending)
+		return;
+
+	for (i = 0; i < LATENCY_EVENTS; ++i) {
+		struct latency_event *ev = &g_latency.events[i];
+
+		if (ev->stage != from || (from == LATENCY_POLLED && (ev->port != port || !(ev->buttons & buttons))))
+			continue;
+
+		if (!now)
+			now = time_ns();
+
+		switch (from) {
+		case LATENCY_ARRIVED:
+			ev->stage = LATENCY_POLLED;
+			break;
+		case LATENCY_POLLED:
+			ev->stage = LATENCY_OBSERVED;
+			ev->time[1] = now;
+			break;
+		case LATENCY_OBSERVED:
+			ev->stage = LATENCY_UPLOADED;
+			ev->time[2] = now;
+			break;
+		case LATENCY_UPLOADED:
+			ev->time[3] = now;
+			for (j = 0; j < LATENCY_SPANS; ++j) {
+				uint64_t span = j == LATENCY_TOTAL ? now - ev->time[0] : ev->time[j + 1] - ev->time[j];
+				unsigned bin = span / 1000000;
+
+				g_latency.hist[j][bin < LATENCY_BINS ? bin : LATENCY_BINS - 1]++;
+				g_latency.sum[j] += span;
+				if (span > g_latency.max[j])
+					g_latency.max[j] = span;
+			}
+			g_latency.count++;
+			g_latency.pending--;
+			ev->stage = LATENCY_FREE;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+
+static double latency_percentile(const unsigned *hist, double p) {
+	unsigned seen = 0, i;
+
+	for (i = 0; i < LATENCY_BINS; ++i)
+		if ((seen += hist[i]) >= p * g_latency.count)
+			break;
+
+	return i + 1;
+}
+
+
+static void latency_print() {
+	unsigned i, j, peak = 0, unread = g_latency.dropped;
+
+	if (!g_latency.enabled)
+		return;
+
+	for (i = 0; i < LATENCY_EVENTS; ++i)
+		if (g_latency.events[i].stage != LATENCY_FREE && g_latency.events[i].stage < LATENCY_OBSERVED)
+			unread++;
+
+	fprintf(stderr, "Input latency over %u events, %u never read by the core:\n", g_latency.count, unread);
+	if (g_latency.untracked)
+		fprintf(stderr, "  %u more arrived while %u read events awaited a present, not tracked\n",
+			g_latency.untracked, LATENCY_EVENTS);
+	if (!g_latency.count)
+		return;
+
+	for (i = 0; i < LATENCY_SPANS; ++i)
+		fprintf(stderr, "  %-20s mean %6.2f ms, p50 < %3.0f ms, p95 < %3.0f ms, max %6.2f ms\n", g_latency_spans[i],
+			g_latency.sum[i] / 1e6 / g_latency.count, latency_percentile(g_latency.hist[i], 0.5),
+			latency_percentile(g_latency.hist[i], 0.95), g_latency.max[i] / 1e6);
+
+	for (i = 0; i < LATENCY_BINS; ++i)
+		if (g_latency.hist[LATENCY_TOTAL][i] > peak)
+			peak = g_latency.hist[LATENCY_TOTAL][i];
+
+	fprintf(stderr, "Event to present:\n");
+	for (i = 0; i < LATENCY_BINS; ++i) {
+		unsigned n = g_latency.hist[LATENCY_TOTAL][i];
+		if (!n)
+			continue;
+
+		fprintf(stderr, "  %s%2u ms |", i == LATENCY_BINS - 1 ? ">=" : "  ", i);
+		for (j = 0; j < (n * 40 + peak - 1) / peak; ++j)
+			fputc('#', stderr);
+		fprintf(stderr, " %u\n", n);
+	}
+}
+
+
+static void key_cb(GLFWwindow *win, int key, int scancode, int action, int mods) {
+	if (key < 0 || key > GLFW_KEY_LAST || action == GLFW_REPEAT)
+		return;
+
+	latency_event(0, g_key_joy[key], time_ns(), LATENCY_ARRIVED);
+
+	if (action == GLFW_PRESS) {
+		atomic_fetch_or_explicit(&g_joy_mask[0], g_key_joy[key], memory_order_relaxed);
+		atomic_fetch_or_explicit(&g_hotkey_mask, g_key_hotkeys[key], memory_order_relaxed);
+	} else {
+		atomic_fetch_and_explicit(&g_joy_mask[0], ~(unsigned)g_key_joy[key], memory_order_relaxed);
+		atomic_fetch_and_explicit(&g_hotkey_mask, ~(unsigned)g_key_hotkeys[key], memory_order_relaxed);
+	}
+}
+
+
+static void input_init() {
+	int i;
+
+	if (!g_win)
+		die("The glfw input backend requires the gl video backend.");
+
+	for (i = 0; g_binds[i].k || g_binds[i].rk; ++i)
+		g_key_joy[g_binds[i].k] |= 1 << g_binds[i].rk;
+
+	for (i = 0; g_hotkey_binds[i].k; ++i)
+		g_key_hotkeys[g_hotkey_binds[i].k] |= g_hotkey_binds[i].rk;
+
+	glfwSetKeyCallback(g_win, key_cb);
+}
+
+
+static unsigned input_pump() {
+	unsigned hotkeys;
+
+	glfwPollEvents();
+
+	hotkeys = atomic_load_explicit(&g_hotkey_mask, memory_order_relaxed);
+
+	// Quit nanoarch when closing the window too.
+	if (glfwWindowShouldClose(g_win))
+		hotkeys |= HOTKEY_QUIT;
+
+	return hotkeys;
+}
+
+
+static void input_poll() {
+	int i;
+
+	for (i = 0; i < MAX_PORTS; ++i)
+		g_joy[i] = atomic_load_explicit(&g_joy_mask[i], memory_order_relaxed);
+}
+
+
+static void input_deinit() {}
+
+
+static const struct input_backend input_glfw = {
+	"glfw",
+	input_init,
+	input_pump,
+	input_poll,
+	input_deinit,
+};
+
+
+static void null_input_init() {}
+static unsigned null_input_pump() { return 0; }
+static void null_input_poll() { memset(g_joy, 0, sizeof(g_joy)); }
+static void null_input_deinit() {}
+
+static const struct input_backend input_null = {
+	"null",
+	null_input_init,
+	null_input_pump,
+	null_input_poll,
+	null_input_deinit,
+};
+
+
+static int gamepad_button(unsigned code) {
+	switch (code) {
+	case BTN_SOUTH: return RETRO_DEVICE_ID_JOYPAD_B;
+	case BTN_EAST: return RETRO_DEVICE_ID_JOYPAD_A;
+	case BTN_NORTH: return RETRO_DEVICE_ID_JOYPAD_X;
+	case BTN_WEST: return RETRO_DEVICE_ID_JOYPAD_Y;
+	case BTN_TL: return RETRO_DEVICE_ID_JOYPAD_L;
+	case BTN_TR: return RETRO_DEVICE_ID_JOYPAD_R;
+	case BTN_TL2: return RETRO_DEVICE_ID_JOYPAD_L2;
+	case BTN_TR2: return RETRO_DEVICE_ID_JOYPAD_R2;
+	case BTN_SELECT: return RETRO_DEVICE_ID_JOYPAD_SELECT;
+	case BTN_START: return RETRO_DEVICE_ID_JOYPAD_START;
+	case BTN_THUMBL: return RETRO_DEVICE_ID_JOYPAD_L3;
+	case BTN_THUMBR: return RETRO_DEVICE_ID_JOYPAD_R3;
+	case BTN_DPAD_UP: return RETRO_DEVICE_ID_JOYPAD_UP;
+	case BTN_DPAD_DOWN: return RETRO_DEVICE_ID_JOYPAD_DOWN;
+	case BTN_DPAD_LEFT: return RETRO_DEVICE_ID_JOYPAD_LEFT;
+	case BTN_DPAD_RIGHT: return RETRO_DEVICE_ID_JOYPAD_RIGHT;
+	}
+
+	return -1;
+}
+
+
+// Maps an axis from the device's range onto libretro's, with its dead zone.
+static int16_t gamepad_scale(const struct input_absinfo *info, int value) {
+	int center = info->minimum + (info->maximum - info->minimum) / 2;
+	long scaled;
+
+	if (info->maximum <= info->minimum || abs(value - center) <= info->flat)
+		return 0;
+
+	scaled = (long)(value - info->minimum) * 65535 / (info->maximum - info->minimum) - 32768;
+	return scaled < -32768 ? -32768 : scaled > 32767 ? 32767 : scaled;
+}
+
+
+static void gamepad_hat(struct gamepad *pad, int value, int neg, int pos) {
+	pad->buttons &= ~(1u << neg | 1u << pos);
+	if (value)
+		pad->buttons |= 1u << (value < 0 ? neg : pos);
+}
+
+
+static void gamepad_axis(struct gamepad *pad, unsigned code, int value) {
+	switch (code) {
+	case ABS_X: pad->axes[RETRO_DEVICE_INDEX_ANALOG_LEFT][RETRO_DEVICE_ID_ANALOG_X] = gamepad_scale(&pad->abs[code], value); break;
+	case ABS_Y: pad->axes[RETRO_DEVICE_INDEX_ANALOG_LEFT][RETRO_DEVICE_ID_ANALOG_Y] = gamepad_scale(&pad->abs[code], value); break;
+	case ABS_RX: pad->axes[RETRO_DEVICE_INDEX_ANALOG_RIGHT][RETRO_DEVICE_ID_ANALOG_X] = gamepad_scale(&pad->abs[code], value); break;
+	case ABS_RY: pad->axes[RETRO_DEVICE_INDEX_ANALOG_RIGHT][RETRO_DEVICE_ID_ANALOG_Y] = gamepad_scale(&pad->abs[code], value); break;
+	case ABS_HAT0X: gamepad_hat(pad, value, RETRO_DEVICE_ID_JOYPAD_LEFT, RETRO_DEVICE_ID_JOYPAD_RIGHT); break;
+	case ABS_HAT0Y: gamepad_hat(pad, value, RETRO_DEVICE_ID_JOYPAD_UP, RETRO_DEVICE_ID_JOYPAD_DOWN); break;
+	// Analog triggers count as pressed past half way.
+	case ABS_Z:
+	case ABS_RZ: {
+		unsigned bit = 1u << (code == ABS_Z ? RETRO_DEVICE_ID_JOYPAD_L2 : RETRO_DEVICE_ID_JOYPAD_R2);
+		if (gamepad_scale(&pad->abs[code], value) > 0)
+			pad->buttons |= bit;
+		else
+			pad->buttons &= ~bit;
+		break;
+	}
+	}
+}
+
+
+static void gamepad_publish(struct gamepad *pad, uint64_t stamp) {
+	unsigned seq = atomic_load_explicit(&pad->seq, memory_order_relaxed);
+	int i, j;
+
+	atomic_store_explicit(&pad->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&pad->pub_buttons, pad->buttons, memory_order_relaxed);
+	for (i = 0; i < 2; ++i)
+		for (j = 0; j < 2; ++j)
+			atomic_store_explicit(&pad->pub_axes[i][j], pad->axes[i][j], memory_order_relaxed);
+	atomic_store_explicit(&pad->pub_stamp, stamp, memory_order_relaxed);
+
+	atomic_store_explicit(&pad->seq, seq + 2, memory_order_release);
+}
+
+
+// Rebuilds the state from the device after opening it or losing events.
+static void gamepad_sync(struct gamepad *pad) {
+	uint8_t keys[KEY_MAX / 8 + 1] = { 0 };
+	unsigned code;
+	int bit;
+
+	pad->buttons = 0;
+	if (ioctl(pad->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0)
+		for (code = BTN_MISC; code < KEY_MAX; ++code)
+			if (keys[code / 8] & 1 << code % 8 && (bit = gamepad_button(code)) >= 0)
+				pad->buttons |= 1u << bit;
+
+	for (code = 0; code < ABS_CNT; ++code)
+		if (ioctl(pad->fd, EVIOCGABS(code), &pad->abs[code]) >= 0)
+			gamepad_axis(pad, code, pad->abs[code].value);
+
+	gamepad_publish(pad, time_ns());
+}
+
+
+static void gamepad_event(struct gamepad *pad, const struct input_event *ev, uint64_t stamp) {
+	int bit;
+
+	pad->events++;
+
+	if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+		pad->dropped = true;
+		return;
+	}
+
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+		if (pad->dropped && !pad->replay) {
+			pad->dropped = false;
+			gamepad_sync(pad);
+		} else {
+			pad->dropped = false;
+			gamepad_publish(pad, stamp);
+		}
+		return;
+	}
+
+	if (pad->dropped)
+		return;
+
+	if (ev->type == EV_KEY && (bit = gamepad_button(ev->code)) >= 0) {
+		if (ev->value)
+			pad->buttons |= 1u << bit;
+		else
+			pad->buttons &= ~(1u << bit);
+	} else if (ev->type == EV_ABS && ev->code < ABS_CNT) {
+		gamepad_axis(pad, ev->code, ev->value);
+	}
+}
+
+
+static uint64_t gamepad_event_time(const struct input_event *ev) {
+	return (uint64_t)ev->input_event_sec * 1000000000ull + ev->input_event_usec * 1000ull;
+}
+
+
+// Reads every device from one thread, so events are handled as they arrive
+// instead of once per frame. The devices stamp events with CLOCK_MONOTONIC.
+static void *gamepad_thread(void *arg) {
+	struct input_event evs[GAMEPAD_EVENTS];
+	struct epoll_event ready[MAX_PORTS + 1];
+	int n, i, j;
+	ssize_t len;
+
+	while (!atomic_load(&g_gamepad.quit)) {
+		n = epoll_wait(g_gamepad.epoll, ready, array_len(ready), -1);
+
+		for (i = 0; i < n; ++i) {
+			struct gamepad *pad = ready[i].data.ptr;
+			if (!pad)
+				continue;
+
+			while ((len = read(pad->fd, evs, sizeof(evs))) > 0)
+				for (j = 0; j < len / (ssize_t)sizeof(*evs); ++j)
+					gamepad_event(pad, &evs[j], gamepad_event_time(&evs[j]));
+
+			if (len < 0 && errno == ENODEV) {
+				fprintf(stderr, "Gamepad on port %ld was disconnected\n", (long)(pad - g_gamepad.pads));
+				epoll_ctl(g_gamepad.epoll, EPOLL_CTL_DEL, pad->fd, NULL);
+				pad->buttons = 0;
+				memset(pad->axes, 0, sizeof(pad->axes));
+				gamepad_publish(pad, time_ns());
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+// Plays back a recorded stream with its original timing. Events are stamped
+// when they're replayed, and axes are taken to use libretro's range as the
+// recording doesn't carry the device's.
+static void *gamepad_replay_thread(void *arg) {
+	struct gamepad *pad = arg;
+	struct input_event ev;
+	uint64_t base = 0, start = time_ns(), target, now;
+
+	while (!atomic_load(&g_gamepad.quit) && read(pad->fd, &ev, sizeof(ev)) == sizeof(ev)) {
+		if (!base)
+			base = gamepad_event_time(&ev);
+		target = start + (gamepad_event_time(&ev) - base);
+
+		// Sleep in slices so a long gap doesn't hold up shutdown.
+		while ((now = time_ns()) < target && !atomic_load(&g_gamepad.quit)) {
+			uint64_t slice = target - now < 50000000 ? target - now : 50000000;
+			struct timespec ts = { 0, slice };
+			nanosleep(&ts, NULL);
+		}
+
+		gamepad_event(pad, &ev, time_ns());
+	}
+
+	return NULL;
+}
+
+
+static bool gamepad_is_gamepad(int fd) {
+	uint8_t keys[KEY_MAX / 8 + 1] = { 0 };
+
+	if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0)
+		return false;
+
+	return keys[BTN_GAMEPAD / 8] & 1 << BTN_GAMEPAD % 8 || keys[BTN_JOYSTICK / 8] & 1 << BTN_JOYSTICK % 8;
+}
+
+
+static bool gamepad_open(const char *path, bool probe) {
+	struct gamepad *pad = &g_gamepad.pads[g_gamepad.count];
+	struct stat st;
+	char name[128] = "?";
+	unsigned i;
+	int clock = CLOCK_MONOTONIC;
+	int fd;
+
+	if (g_gamepad.count == MAX_PORTS)
+		return false;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		if (!probe)
+			die("Failed to open gamepad '%s': %s", path, strerror(errno));
+		return false;
+	}
+
+	memset(pad, 0, sizeof(*pad));
+	pad->fd = fd;
+	pad->replay = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+	if (pad->replay) {
+		fcntl(fd, F_SETFL, 0);
+		for (i = 0; i < ABS_CNT; ++i) {
+			pad->abs[i].minimum = -32768;
+			pad->abs[i].maximum = 32767;
+		}
+		fprintf(stderr, "Gamepad on port %u: replaying '%s'\n", g_gamepad.count, path);
+	} else {
+		if (!gamepad_is_gamepad(fd)) {
+			close(fd);
+			if (!probe)
+				die("'%s' is not a gamepad", path);
+			return false;
+		}
+
+		ioctl(fd, EVIOCSCLOCKID, &clock);
+		ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+		gamepad_sync(pad);
+		fprintf(stderr, "Gamepad on port %u: %s (%s)\n", g_gamepad.count, name, path);
+	}
+
+	g_gamepad.count++;
+	return true;
+}
+
+
+static void gamepad_init() {
+	char path[32];
+	unsigned i, j;
+
+	for (i = 0; i < g_gamepad.npaths; ++i) {
+		if (strcmp(g_gamepad.paths[i], "auto")) {
+			gamepad_open(g_gamepad.paths[i], false);
+			continue;
+		}
+
+		for (j = 0; j < 64 && g_gamepad.count < MAX_PORTS; ++j) {
+			snprintf(path, sizeof(path), "/dev/input/event%u", j);
+			gamepad_open(path, true);
+		}
+	}
+
+	if (!g_gamepad.count)
+		return;
+
+	g_gamepad.epoll = epoll_create1(EPOLL_CLOEXEC);
+	g_gamepad.wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (g_gamepad.epoll < 0 || g_gamepad.wake < 0)
+		die("Failed to set up the gamepad reader: %s", strerror(errno));
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(g_gamepad.epoll, EPOLL_CTL_ADD, g_gamepad.wake, &ev);
+
+	for (i = 0; i < g_gamepad.count; ++i) {
+		struct gamepad *pad = &g_gamepad.pads[i];
+
+		if (pad->replay) {
+			if (pthread_create(&pad->thread, NULL, gamepad_replay_thread, pad))
+				die("Failed to start the gamepad replay thread");
+			continue;
+		}
+
+		ev.data.ptr = pad;
+		if (epoll_ctl(g_gamepad.epoll, EPOLL_CTL_ADD, pad->fd, &ev) < 0)
+			die("Failed to watch gamepad on port %u: %s", i, strerror(errno));
+	}
+
+	if (pthread_create(&g_gamepad.thread, NULL, gamepad_thread, NULL))
+		die("Failed to start the gamepad thread");
+	g_gamepad.running = true;
+}
+
+
+// ORs each pad into its port's snapshot, after the input backend took its own.
+static void gamepad_poll() {
+	unsigned i, j, k, seq, buttons;
+	int16_t axes[2][2];
+	uint64_t stamp;
+
+	for (i = 0; i < g_gamepad.count; ++i) {
+		struct gamepad *pad = &g_gamepad.pads[i];
+
+		do {
+			seq = atomic_load_explicit(&pad->seq, memory_order_acquire);
+			buttons = atomic_load_explicit(&pad->pub_buttons, memory_order_relaxed);
+			for (j = 0; j < 2; ++j)
+				for (k = 0; k < 2; ++k)
+					axes[j][k] = atomic_load_explicit(&pad->pub_axes[j][k], memory_order_relaxed);
+			stamp = atomic_load_explicit(&pad->pub_stamp, memory_order_relaxed);
+			atomic_thread_fence(memory_order_acquire);
+		} while (seq & 1 || seq != atomic_load_explicit(&pad->seq, memory_order_relaxed));
+
+		g_joy[i] |= buttons;
+		memcpy(g_analog[i], axes, sizeof(axes));
+
+		if (stamp != pad->seen_stamp) {
+			uint64_t now = time_ns(), age = now > stamp ? now - stamp : 0;
+			latency_event(i, buttons ^ pad->seen_buttons, stamp, LATENCY_POLLED);
+			pad->seen_buttons = buttons;
+			pad->seen_stamp = stamp;
+			g_gamepad.reports++;
+			g_gamepad.age_sum += age;
+			if (age > g_gamepad.age_max)
+				g_gamepad.age_max = age;
+		}
+	}
+}
+
+
+static void gamepad_deinit() {
+	uint64_t one = 1;
+	unsigned i;
+
+	if (g_gamepad.running) {
+		atomic_store(&g_gamepad.quit, true);
+		if (write(g_gamepad.wake, &one, sizeof(one)) < 0)
+			perror("write");
+		pthread_join(g_gamepad.thread, NULL);
+		g_gamepad.running = false;
+	}
+
+	for (i = 0; i < g_gamepad.count; ++i) {
+		struct gamepad *pad = &g_gamepad.pads[i];
+		if (pad->replay)
+			pthread_join(pad->thread, NULL);
+		fprintf(stderr, "Gamepad on port %u: %llu events\n", i, (unsigned long long)pad->events);
+		close(pad->fd);
+	}
+
+	if (g_gamepad.reports)
+		fprintf(stderr, "Gamepad reports: %llu, event to poll avg %.3f ms max %.3f ms\n",
+			(unsigned long long)g_gamepad.reports, g_gamepad.age_sum / 1e6 / g_gamepad.reports,
+			g_gamepad.age_max / 1e6);
+
+	if (g_gamepad.wake >= 0)
+		close(g_gamepad.wake);
+	if (g_gamepad.epoll >= 0)
+		close(g_gamepad.epoll);
+	g_gamepad.count = 0;
+	g_gamepad.wake = g_gamepad.epoll = -1;
+}
+
+
+static const struct video_backend *g_video_backends[] = { &video_gl, &video_egl, &video_null };
+static const struct audio_backend *g_audio_backends[] = { &audio_alsa, &audio_alsa_mmap, &audio_file, &audio_null };
+static const struct input_backend *g_input_backends[] = { &input_glfw, &input_null };
+
+static const struct video_backend *find_video_backend(const char *name) {
+	int i;
+
+	for (i = 0; i < array_len(g_video_backends); ++i)
+		if (!strcmp(g_video_backends[i]->name, name))
+			return g_video_backends[i];
+
+	die("Unknown video backend '%s'", name);
+	return NULL;
+}
+
+
+static const struct audio_backend *find_audio_backend(const char *name) {
+	int i;
+
+	for (i = 0; i < array_len(g_audio_backends); ++i)
+		if (!strcmp(g_audio_backends[i]->name, name))
+			return g_audio_backends[i];
+
+	die("Unknown audio backend '%s'", name);
+	return NULL;
+}
+
+
+static const struct input_backend *find_input_backend(const char *name) {
+	int i;
+
+	for (i = 0; i < array_len(g_input_backends); ++i)
+		if (!strcmp(g_input_backends[i]->name, name))
+			return g_input_backends[i];
+
+	die("Unknown input backend '%s'", name);
+	return NULL;
+}
+
+
+// Copies a frame into the back slot and makes it the newest finished frame.
+static void frames_publish(const void *data, unsigned width, unsigned height, size_t pitch) {
+	unsigned state = atomic_load_explicit(&g_frames.state, memory_order_relaxed);
+	struct frame *f = &g_frames.slots[FRAME_BACK(state)];
+	size_t size = pitch * height;
+	unsigned next;
+
+	if (f->size < size) {
+		free(f->data);
+
+		if (posix_memalign(&f->data, FRAMEBUFFER_ALIGN, size))
+			die("Failed to allocate a %zu byte frame", size);
+
+		f->size = size;
+	}
+
+	// Cores rendering into the slot from frames_framebuffer need no copy. The
+	// core's last row ends at the width, so the copy stops there too.
+	if (data != f->data && height)
+		memcpy(f->data, data, pitch * (height - 1) + (size_t)width * g_video.bpp);
+	f->width = width;
+	f->height = height;
+	f->pitch = pitch;
+
+	do {
+		next = FRAME_MIDDLE(state) | FRAME_BACK(state) << 2 | FRAME_FRONT(state) << 4 | FRAME_FRESH;
+	} while (!atomic_compare_exchange_weak_explicit(&g_frames.state, &state, next,
+			memory_order_acq_rel, memory_order_relaxed));
+}
+
+
+// Lends the core the back slot, which only the emulation thread touches
+// until frames_publish hands it over.
+static bool frames_framebuffer(struct retro_framebuffer *fb) {
+	unsigned state = atomic_load_explicit(&g_frames.state, memory_order_relaxed);
+	struct frame *f = &g_frames.slots[FRAME_BACK(state)];
+	size_t pitch = framebuffer_pitch(fb->width);
+
+	if (f->size < pitch * fb->height) {
+		free(f->data);
+
+		if (posix_memalign(&f->data, FRAMEBUFFER_ALIGN, pitch * fb->height))
+			die("Failed to allocate a %zu byte frame", pitch * fb->height);
+
+		f->size = pitch * fb->height;
+	}
+
+	fb->data = f->data;
+	fb->pitch = pitch;
+	fb->format = g_pixel_format;
+	fb->memory_flags = RETRO_MEMORY_TYPE_CACHED;
+
+	return true;
+}
+
+
+// Returns the newest finished frame, or NULL if none arrived since last call.
+static struct frame *frames_acquire() {
+	unsigned state = atomic_load_explicit(&g_frames.state, memory_order_acquire);
+	unsigned next;
+
+	do {
+		if (!(state & FRAME_FRESH))
+			return NULL;
+
+		next = FRAME_BACK(state) | FRAME_FRONT(state) << 2 | FRAME_MIDDLE(state) << 4;
+	} while (!atomic_compare_exchange_weak_explicit(&g_frames.state, &state, next,
+			memory_order_acq_rel, memory_order_acquire));
+
+	return &g_frames.slots[FRAME_FRONT(next)];
+}
+
+
+static void frames_deinit() {
+	int i;
+
+	for (i = 0; i < 3; ++i)
+		free(g_frames.slots[i].data);
+
+	memset(g_frames.slots, 0, sizeof(g_frames.slots));
+}
+
+
+static void pace_init(double fps) {
+	double hz = g_video_backend->refresh_rate();
+
+	if (g_pace.source == PACE_VSYNC && g_video_backend != &video_gl) {
+		fprintf(stderr, "No vsync without the gl video backend, pacing with a timer\n");
+		g_pace.source = PACE_TIMER;
+	}
+
+	// Vsync is only the default when it runs the core at its own rate.
+	if (g_pace.source == PACE_VSYNC && g_pace.automatic && !(hz > 0 && fabs(fps / hz - 1) < 0.01)) {
+		fprintf(stderr, "The display runs at %.2f Hz rather than the core's %.2f fps, pacing with a timer\n", hz, fps);
+		g_pace.source = PACE_TIMER;
+		g_video_backend->set_vsync(false);
+	}
+
+	// Without a swap to block on, a skipped present would leave vsync pacing
+	// running flat out.
+	if (g_video.skip_present && g_pace.source == PACE_VSYNC && !g_threaded) {
+		fprintf(stderr, "Presents can't be skipped when pacing by vsync, drawing every frame\n");
+		g_video.skip_present = false;
+	}
+
+	if (g_pace.source == PACE_AUDIO && g_audio_cb.cb.callback) {
+		fprintf(stderr, "Audio is written from the audio callback thread, pacing with a timer\n");
+		g_pace.source = PACE_TIMER;
+	}
+
+	if (g_pace.source == PACE_AUDIO && g_audio_backend == &audio_null) {
+		fprintf(stderr, "No audio clock with the null audio backend, pacing with a timer\n");
+		g_pace.source = PACE_TIMER;
+	}
+
+	// The audio clock would run the core at full speed regardless.
+	if (g_slowmo != 1 && (g_pace.source == PACE_AUDIO || g_pace.source == PACE_NONE)) {
+		fprintf(stderr, "Slow motion needs a frame timer, pacing with one\n");
+		g_pace.source = PACE_TIMER;
+	}
+
+	// The presenter can't hold back an emulation thread, so vsync only applies
+	// to presentation there. Slow-motion needs the timer on top of vsync.
+	g_pace.sleep = g_pace.source == PACE_TIMER || (g_pace.source == PACE_VSYNC && (g_threaded || g_slowmo != 1));
+	g_pace.period = 1e9 / (fps > 0 ? fps : 60) * g_slowmo;
+	g_pace.next = time_ns() + g_pace.period;
+}
+
+
+// Waits for the next frame deadline when pacing by timer.
+static void pace_wait() {
+	uint64_t now = time_ns();
+	bool sleep = g_pace.sleep;
+
+	// Frames that wrote no audio, while paused or rewinding, have nothing to
+	// block on, so they fall back to the timer.
+	if (g_pace.source == PACE_AUDIO) {
+		if (!atomic_exchange_explicit(&g_pace.audio_written, false, memory_order_relaxed)) {
+			sleep = true;
+		} else {
+			g_pace.next = 0;
+
+			// Blocking writes no longer pace us with async audio, so hold
+			// back while the ring is over half full instead.
+			if (g_audio_async.enabled) {
+				struct timespec ts = { 0, 500000 };
+
+				while (audio_ring_fill(&g_audio_async.ring) > g_audio_async.ring.capacity / 2 &&
+						!atomic_load_explicit(&g_ff.active, memory_order_relaxed))
+					nanosleep(&ts, NULL);
+			}
+
+			return;
+		}
+	}
+
+	if (!sleep)
+		return;
+
+	// Restart from now once fast-forward ends.
+	if (atomic_load_explicit(&g_ff.active, memory_order_relaxed)) {
+		g_pace.next = 0;
+		return;
+	}
+
+	if (!g_pace.next)
+		g_pace.next = now + g_pace.period;
+
+	if (now + PACE_SPIN_NS < g_pace.next) {
+		uint64_t wake = g_pace.next - PACE_SPIN_NS;
+		struct timespec ts = { wake / 1000000000ull, wake % 1000000000ull };
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+	}
+
+	while ((now = time_ns()) < g_pace.next);
+
+	g_pace.frames++;
+	g_pace.late += now - g_pace.next;
+	if (now - g_pace.next > g_pace.max_late)
+		g_pace.max_late = now - g_pace.next;
+
+	// Deadlines are absolute so lateness doesn't accumulate, unless we fall a
+	// whole frame behind, in which case catching up would only cause a burst.
+	g_pace.next += g_pace.period;
+	if (now > g_pace.next) {
+		g_pace.next = now + g_pace.period;
+		g_pace.resyncs++;
+	}
+}
+
+
+static void pace_deinit() {
+	if (!g_pace.frames)
+		return;
+
+	fprintf(stderr, "Paced %llu frames at %.3f fps: mean lateness %.1f us, max %.1f us, %u resyncs\n",
+		(unsigned long long)g_pace.frames, 1e9 / g_pace.period, g_pace.late / 1e3 / g_pace.frames,
+		g_pace.max_late / 1e3, g_pace.resyncs);
+}
+
+
+static enum pace_source find_pace_source(const char *name) {
+	int i;
+
+	for (i = 0; i < array_len(g_pace_names); ++i)
+		if (!strcmp(g_pace_names[i], name))
+			return i;
+
+	die("Unknown pacing source '%s'", name);
+	return PACE_TIMER;
+}
+
+
+static void core_log(enum retro_log_level level, const char *fmt, ...) {
+	char buffer[4096] = {0};
+	static const char * levelstr[] = { "dbg", "inf", "wrn", "err" };
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, va);
+	va_end(va);
+
+	if (level == 0)
+		return;
+
+	fprintf(stderr, "[%s] %s", levelstr[level], buffer);
+	fflush(stderr);
+
+	if (level == RETRO_LOG_ERROR)
+		exit(EXIT_FAILURE);
+}
+
+
+static bool core_environment(unsigned cmd, void *data) {
+	bool *bval;
+
+	switch (cmd) {
+	case RETRO_ENVIRONMENT_GET_LOG_INTERFACE: {
+		struct retro_log_callback *cb = (struct retro_log_callback *)data;
+		cb->log = core_log;
+		break;
+	}
+	case RETRO_ENVIRONMENT_GET_INPUT_BITMASKS:
+		if (data)
+			*(bool *)data = true;
+		break;
+	case RETRO_ENVIRONMENT_GET_CAN_DUPE:
+		bval = (bool*)data;
+		*bval = true;
+		break;
+	case RETRO_ENVIRONMENT_SET_PIXEL_FORMAT: {
+		const enum retro_pixel_format *fmt = (enum retro_pixel_format *)data;
+
+		if (*fmt > RETRO_PIXEL_FORMAT_RGB565 || !g_video_backend->set_pixel_format(*fmt))
+			return false;
+
+		g_pixel_format = *fmt;
+		break;
+	}
+	case RETRO_ENVIRONMENT_SET_HW_RENDER: {
+		struct retro_hw_render_callback *hw = data;
+
+		// The emulation thread has no GL context to render with.
+		if (g_threaded || !g_video_backend->set_hw_render(hw))
+			return false;
+
+		g_hw_render = *hw;
+		break;
+	}
+	case RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER: {
+		struct retro_framebuffer *fb = data;
+
+		if (g_threaded)
+			return frames_framebuffer(fb);
+
+		return g_video_backend->get_framebuffer(fb);
+	}
+	case RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK:
+		g_frame_time.cb = *(const struct retro_frame_time_callback *)data;
+		g_frame_time.fixed = g_slowmo != 1;
+		break;
+	case RETRO_ENVIRONMENT_SET_AUDIO_CALLBACK:
+		g_audio_cb.cb = *(const struct retro_audio_callback *)data;
+		break;
+	case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
+	case RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY:
+		*(const char **)data = ".";
+		return true;
+
+	default:
+		core_log(RETRO_LOG_DEBUG, "Unhandled env #%u", cmd);
+		return false;
+	}
+
+	return true;
+}
+
+
+static void core_video_refresh(const void *data, unsigned width, unsigned height, size_t pitch) {
+	if (!data || g_video_suppressed)
+		return;
+
+	if (g_threaded)
+		frames_publish(data, width, height, pitch);
+	else
+		g_video_backend->refresh(data, width, height, pitch);
+
+	latency_advance(LATENCY_OBSERVED, 0, 0);
+}
+
+
+static void core_input_poll(void) {
+	g_input_backend->poll();
+	latency_advance(LATENCY_ARRIVED, 0, 0);
+	gamepad_poll();
+}
+
+
+static int16_t core_input_state(unsigned port, unsigned device, unsigned index, unsigned id) {
+	if (port >= MAX_PORTS)
+		return 0;
+
+	switch (device) {
+	case RETRO_DEVICE_JOYPAD:
+		if (g_latency.pending)
+			latency_advance(LATENCY_POLLED, port, id == RETRO_DEVICE_ID_JOYPAD_MASK ? ~0u : 1u << id);
+		if (id == RETRO_DEVICE_ID_JOYPAD_MASK)
+			return g_joy[port];
+		return id <= RETRO_DEVICE_ID_JOYPAD_R3 && (g_joy[port] >> id) & 1;
+	case RETRO_DEVICE_ANALOG:
+		if (index <= RETRO_DEVICE_INDEX_ANALOG_RIGHT && id <= RETRO_DEVICE_ID_ANALOG_Y)
+			return g_analog[port][index][id];
+		break;
+	}
+
+	return 0;
+}
+
+
+static void drc_init() {
+	double hz = g_video_backend->refresh_rate();
+	double fps = g_av.timing.fps;
+
+	// The device clock is the master when pacing by audio. The file and null
+	// sinks have no clock to steer towards, and recordings have to come out
+	// the same on every run, even when the async ring reports a fill.
+	if (g_pace.source == PACE_AUDIO || (!g_audio_async.enabled && g_audio_backend->fill() < 0) ||
+			g_audio_backend == &audio_file || g_audio_backend == &audio_null)
+		g_drc.enabled = false;
+
+	// Slowed down, the core makes audio 1/factor as fast as it's played, so
+	// it's stretched by the factor even where there's no rate control.
+	if (!g_drc.enabled && g_slowmo != 1) {
+		g_drc.enabled = true;
+		g_drc.max_dev = 0;
+	}
+
+	if (!g_drc.enabled)
+		return;
+
+	// Under vsync the core runs at the display's rate, so its audio has to be
+	// stretched back to the core's rate. Large mismatches mean the display
+	// isn't pacing the core at all.
+	g_drc.base_ratio = g_slowmo;
+	if (g_pace.source == PACE_VSYNC && !g_pace.sleep && hz > 0 && fabs(fps / hz - 1) < 0.01)
+		g_drc.base_ratio = fps / hz;
+
+	g_drc.pos = 1;
+}
+
+
+static void drc_deinit() {
+	if (g_drc.batches)
+		fprintf(stderr, "Rate control: nominal ratio %.5f, mean %.5f\n",
+			g_drc.base_ratio, g_drc.ratio_sum / g_drc.batches);
+
+	free(g_drc.in);
+	free(g_drc.out);
+	free(g_drc.out16);
+	g_drc.in = g_drc.out = NULL;
+	g_drc.out16 = NULL;
+}
+
+
+static void drc_reserve(size_t in_frames, size_t out_frames) {
+	if (in_frames > g_drc.in_cap) {
+		float *in = realloc(g_drc.in, in_frames * 2 * sizeof(float));
+
+		if (!in)
+			die("Failed to allocate the resampler buffers");
+
+		if (!g_drc.in_cap)
+			memset(in, 0, DRC_HISTORY * 2 * sizeof(float));
+
+		g_drc.in = in;
+		g_drc.in_cap = in_frames;
+	}
+
+	if (out_frames > g_drc.out_cap) {
+		free(g_drc.out);
+		free(g_drc.out16);
+		g_drc.out = malloc(out_frames * 2 * sizeof(float));
+		g_drc.out16 = malloc(out_frames * 2 * sizeof(int16_t));
+
+		if (!g_drc.out || !g_drc.out16)
+			die("Failed to allocate the resampler buffers");
+
+		g_drc.out_cap = out_frames;
+	}
+}
+
+
+static void drc_convert_in(float *dst, const int16_t *src, size_t samples) {
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 8 <= samples; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+		_mm_storeu_ps(dst + i, _mm_cvtepi32_ps(lo));
+		_mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(hi));
+	}
+#endif
+
+	for (; i < samples; ++i)
+		dst[i] = src[i];
+}
+
+
+static void drc_convert_out(int16_t *dst, const float *src, size_t samples) {
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 8 <= samples; i += 8) {
+		__m128i lo = _mm_cvtps_epi32(_mm_loadu_ps(src + i));
+		__m128i hi = _mm_cvtps_epi32(_mm_loadu_ps(src + i + 4));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+	}
+#endif
+
+	for (; i < samples; ++i) {
+		float v = src[i] + (src[i] < 0 ? -0.5f : 0.5f);
+		dst[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)v;
+	}
+}
+
+
+// Catmull-Rom interpolation between frames 1 and 2 of four interleaved
+// stereo frames at p, writing one stereo frame to out.
+static inline void drc_cubic(float *out, const float *p, float t) {
+	float t2 = t * t, t3 = t2 * t;
+	float c0 = -0.5f * t3 + t2 - 0.5f * t;
+	float c1 = 1.5f * t3 - 2.5f * t2 + 1.0f;
+	float c2 = -1.5f * t3 + 2.0f * t2 + 0.5f * t;
+	float c3 = 0.5f * t3 - 0.5f * t2;
+
+#ifdef __SSE2__
+	// [L0 R0 L1 R1] * [c0 c0 c1 c1] + [L2 R2 L3 R3] * [c2 c2 c3 c3], then the
+	// halves are added to give [L R].
+	__m128 a = _mm_mul_ps(_mm_loadu_ps(p), _mm_setr_ps(c0, c0, c1, c1));
+	__m128 b = _mm_mul_ps(_mm_loadu_ps(p + 4), _mm_setr_ps(c2, c2, c3, c3));
+	__m128 sum = _mm_add_ps(a, b);
+
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	_mm_storel_pi((__m64 *)out, sum);
+#else
+	out[0] = p[0] * c0 + p[2] * c1 + p[4] * c2 + p[6] * c3;
+	out[1] = p[1] * c0 + p[3] * c1 + p[5] * c2 + p[7] * c3;
+#endif
+}
+
+
+// Resamples a batch at a ratio steered by how full the device queue is.
+static size_t drc_process(const int16_t *data, size_t frames, const int16_t **out) {
+	double fill = g_audio_async.enabled
+		? (double)audio_ring_fill(&g_audio_async.ring) / g_audio_async.ring.capacity
+		: g_audio_backend->fill();
+	double ratio = g_drc.base_ratio;
+	size_t total = DRC_HISTORY + frames;
+	size_t n = 0;
+	double step;
+
+	if (fill >= 0)
+		ratio *= 1 + g_drc.max_dev * (1 - 2 * (fill > 1 ? 1 : fill));
+
+	g_drc.ratio_sum += ratio;
+	g_drc.batches++;
+
+	drc_reserve(total, frames * ratio + 4);
+	drc_convert_in(g_drc.in + DRC_HISTORY * 2, data, frames * 2);
+
+	step = 1 / ratio;
+
+	// pos indexes the second tap, interpolating between it and the next.
+	while (g_drc.pos + 2 < total && n < g_drc.out_cap) {
+		size_t i = (size_t)g_drc.pos;
+		drc_cubic(g_drc.out + n * 2, g_drc.in + (i - 1) * 2, g_drc.pos - i);
+		g_drc.pos += step;
+		n++;
+	}
+
+	memmove(g_drc.in, g_drc.in + frames * 2, DRC_HISTORY * 2 * sizeof(float));
+	g_drc.pos -= frames;
+
+	drc_convert_out(g_drc.out16, g_drc.out, n * 2);
+	*out = g_drc.out16;
+
+	return n;
+}
+
+
+static size_t audio_push(const int16_t *data, size_t frames) {
+	size_t consumed = frames, written;
+
+	atomic_store_explicit(&g_pace.audio_written, true, memory_order_relaxed);
+
+	// The core is told everything was consumed, whatever the resampled size.
+	if (g_drc.enabled)
+		frames = drc_process(data, frames, &data);
+
+	if (g_audio_async.enabled) {
+		written = audio_ring_write(&g_audio_async.ring, data, frames);
+
+		if (written < frames)
+			atomic_fetch_add_explicit(&g_audio_stats.overruns, frames - written, memory_order_relaxed);
+
+		return consumed;
+	}
+
+	atomic_fetch_add_explicit(&g_audio_stats.writes, 1, memory_order_relaxed);
+	written = g_audio_backend->write(data, frames);
+
+	return g_drc.enabled ? consumed : written;
+}
+
+
+// Drains the ring into the audio backend, blocking there instead of in the
+// core's callbacks.
+static void *audio_writer_thread(void *arg) {
+	struct audio_ring *r = &g_audio_async.ring;
+	bool starved = false;
+	size_t written;
+
+	while (!atomic_load_explicit(&g_audio_async.quit, memory_order_relaxed)) {
+		const int16_t *data;
+		size_t frames = audio_ring_peek(r, &data);
+
+		if (!frames) {
+			struct timespec ts = { 0, 1000000 };
+
+			if (!starved)
+				atomic_fetch_add_explicit(&g_audio_stats.underruns, 1, memory_order_relaxed);
+
+			starved = true;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		starved = false;
+		atomic_fetch_add_explicit(&g_audio_stats.writes, 1, memory_order_relaxed);
+
+		// Partial writes are picked up next time around, failed ones dropped.
+		written = g_audio_backend->write(data, frames);
+		audio_ring_consume(r, written ? written : frames);
+	}
+
+	return NULL;
+}
+
+
+static void audio_async_init(double sample_rate) {
+	if (!g_audio_async.enabled)
+		return;
+
+	// Roughly 100ms of audio.
+	audio_ring_init(&g_audio_async.ring, (sample_rate > 0 ? sample_rate : 48000) / 10);
+
+	if (pthread_create(&g_audio_async.thread, NULL, audio_writer_thread, NULL))
+		die("Failed to create the audio writer thread");
+}
+
+
+static void audio_async_deinit() {
+	if (!g_audio_async.enabled)
+		return;
+
+	atomic_store(&g_audio_async.quit, true);
+	pthread_join(g_audio_async.thread, NULL);
+	audio_ring_deinit(&g_audio_async.ring);
+}
+
+
+// Blocks until more audio can be queued, on the ring when writing is async.
+static bool audio_queue_wait(int timeout_ms) {
+	struct audio_ring *r = &g_audio_async.ring;
+	struct timespec ts = { 0, 1000000 };
+
+	if (!g_audio_async.enabled)
+		return g_audio_backend->wait(timeout_ms);
+
+	for (; timeout_ms > 0; --timeout_ms) {
+		if (audio_ring_fill(r) < r->capacity / 2)
+			return true;
+
+		nanosleep(&ts, NULL);
+	}
+
+	return false;
+}
+
+
+static void audio_flush() {
+	if (g_audio_batch.frames)
+		audio_push(g_audio_batch.data, g_audio_batch.frames);
+
+	g_audio_batch.frames = 0;
+}
+
+
+static void core_audio_sample(int16_t left, int16_t right) {
+	if (g_audio_suppressed)
+		return;
+
+	g_audio_batch.data[g_audio_batch.frames * 2] = left;
+	g_audio_batch.data[g_audio_batch.frames * 2 + 1] = right;
+
+	if (++g_audio_batch.frames == AUDIO_BATCH_FRAMES)
+		audio_flush();
+}
+
+
+static size_t core_audio_sample_batch(const int16_t *data, size_t frames) {
+	if (g_audio_suppressed)
+		return frames;
+
+	// Keep ordering with any samples staged earlier in the frame.
+	audio_flush();
+
+	return audio_push(data, frames);
+}
+
+
+static void core_load(const char *sofile) {
+	void (*set_environment)(retro_environment_t) = NULL;
+	void (*set_video_refresh)(retro_video_refresh_t) = NULL;
+	void (*set_input_poll)(retro_input_poll_t) = NULL;
+	void (*set_input_state)(retro_input_state_t) = NULL;
+	void (*set_audio_sample)(retro_audio_sample_t) = NULL;
+	void (*set_audio_sample_batch)(retro_audio_sample_batch_t) = NULL;
+
+	memset(&g_retro, 0, sizeof(g_retro));
+	g_retro.handle = dlopen(sofile, RTLD_LAZY);
+
+	if (!g_retro.handle)
+		die("Failed to load core: %s", dlerror());
+
+	dlerror();
+
+	load_retro_sym(retro_init);
+	load_retro_sym(retro_deinit);
+	load_retro_sym(retro_api_version);
+	load_retro_sym(retro_get_system_info);
+	load_retro_sym(retro_get_system_av_info);
+	load_retro_sym(retro_set_controller_port_device);
+	load_retro_sym(retro_reset);
+	load_retro_sym(retro_run);
+	load_retro_sym(retro_load_game);
+	load_retro_sym(retro_unload_game);
+	load_retro_sym(retro_serialize_size);
+	load_retro_sym(retro_serialize);
+	load_retro_sym(retro_unserialize);
+
+	load_sym(set_environment, retro_set_environment);
+	load_sym(set_video_refresh, retro_set_video_refresh);
+	load_sym(set_input_poll, retro_set_input_poll);
+	load_sym(set_input_state, retro_set_input_state);
+	load_sym(set_audio_sample, retro_set_audio_sample);
+	load_sym(set_audio_sample_batch, retro_set_audio_sample_batch);
+
+	set_environment(core_environment);
+	set_video_refresh(core_video_refresh);
+	set_input_poll(core_input_poll);
+	set_input_state(core_input_state);
+	set_audio_sample(core_audio_sample);
+	set_audio_sample_batch(core_audio_sample_batch);
+
+	g_retro.retro_init();
+	g_retro.initialized = true;
+
+	puts("Core loaded");
+}
+
+
+static void core_load_game(const char *filename) {
+	struct retro_system_info system = {0};
+	struct retro_game_info info = { filename, 0 };
+	FILE *file = fopen(filename, "rb");
+
+	if (!file)
+		goto libc_error;
+
+	fseek(file, 0, SEEK_END);
+	info.size = ftell(file);
+	rewind(file);
+
+	g_retro.retro_get_system_info(&system);
+
+	if (!system.need_fullpath) {
+		info.data = malloc(info.size);
+
+		if (!info.data || !fread((void*)info.data, info.size, 1, file))
+			goto libc_error;
+	}
+
+	if (!g_retro.retro_load_game(&info))
+		die("The core failed to load the content.");
+
+	g_retro.retro_get_system_av_info(&g_av);
+
+	g_video_backend->configure(&g_av.geometry);
+	// Keep running without sound on machines with no audio device.
+	if (!g_audio_backend->init(g_av.timing.sample_rate)) {
+		fprintf(stderr, "Falling back to the null audio backend\n");
+		g_audio_backend = &audio_null;
+		g_audio_backend->init(g_av.timing.sample_rate);
+	}
+
+	return;
+
+libc_error:
+	die("Failed to load content '%s': %s", filename, strerror(errno));
+}
+
+
+static void core_unload() {
+	// The core can free its GL resources while the context is still there.
+	if (g_hw_render.context_destroy)
+		g_hw_render.context_destroy();
+
+	if (g_retro.initialized)
+		g_retro.retro_deinit();
+
+	if (g_retro.handle)
+		dlclose(g_retro.handle);
+}
+
+
+// Calls the core's audio callback whenever the device can take more samples,
+// and turns it off while paused or fast-forwarding.
+static void *audio_thread(void *arg) {
+	bool enabled = false;
+
+	while (!atomic_load(&g_audio_cb.quit)) {
+		bool wanted = !atomic_load(&g_paused) && !atomic_load(&g_ff.active);
+
+		if (wanted != enabled) {
+			enabled = wanted;
+
+			if (g_audio_cb.cb.set_state)
+				g_audio_cb.cb.set_state(enabled);
+		}
+
+		if (!enabled) {
+			struct timespec ts = { 0, 10000000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		if (audio_queue_wait(100)) {
+			g_audio_cb.cb.callback();
+			audio_flush();
+		}
+	}
+
+	if (enabled && g_audio_cb.cb.set_state)
+		g_audio_cb.cb.set_state(false);
+
+	return NULL;
+}
+
+
+static void audio_stats_print() {
+	if (!g_audio_stats.frames)
+		return;
+
+	fprintf(stderr, "Audio: %.2f device writes per frame, %lu device underruns\n",
+		(double)atomic_load(&g_audio_stats.writes) / g_audio_stats.frames,
+		atomic_load(&g_audio_stats.xruns));
+
+	if (g_audio_async.enabled)
+		fprintf(stderr, "Audio ring: %lu frames dropped when full, ran dry %lu times\n",
+			atomic_load(&g_audio_stats.overruns), atomic_load(&g_audio_stats.underruns));
+}
+
+
+static void audio_callback_init() {
+	if (!g_audio_cb.cb.callback)
+		return;
+
+	if (pthread_create(&g_audio_cb.thread, NULL, audio_thread, NULL))
+		die("Failed to create the audio thread");
+}
+
+
+static void audio_callback_deinit() {
+	if (!g_audio_cb.cb.callback)
+		return;
+
+	atomic_store(&g_audio_cb.quit, true);
+	pthread_join(g_audio_cb.thread, NULL);
+}
+
+
+static void runahead_init() {
+	if (!g_runahead.frames)
+		return;
+
+	g_runahead.size = g_retro.retro_serialize_size();
+
+	if (!g_runahead.size) {
+		fprintf(stderr, "The core doesn't support savestates, run-ahead disabled\n");
+		g_runahead.frames = 0;
+		return;
+	}
+
+	if (!(g_runahead.state = malloc(g_runahead.size)))
+		die("Failed to allocate the run-ahead state");
+}
+
+
+static void runahead_deinit() {
+	free(g_runahead.state);
+	g_runahead.state = NULL;
+}
+
+
+static void rewind_init() {
+	if (!g_rewind.capacity)
+		return;
+
+	g_rewind.size = g_retro.retro_serialize_size();
+
+	if (!g_rewind.size) {
+		fprintf(stderr, "The core doesn't support savestates, rewind disabled\n");
+		g_rewind.capacity = 0;
+		return;
+	}
+
+	if (!g_rewind.interval)
+		g_rewind.interval = 1;
+
+	g_rewind.words = (g_rewind.size + 7) / 8;
+	g_rewind.ring = malloc(g_rewind.capacity);
+	g_rewind.current = calloc(g_rewind.words, 8);
+	g_rewind.scratch = calloc(g_rewind.words, 8);
+	g_rewind.delta = malloc(g_rewind.words * 12 + 16);
+
+	if (!g_rewind.ring || !g_rewind.current || !g_rewind.scratch || !g_rewind.delta)
+		die("Failed to allocate the rewind buffer");
+
+	g_rewind.countdown = 1;
+}
+
+
+static void rewind_deinit() {
+	if (g_rewind.pushed)
+		fprintf(stderr, "Rewind: %u snapshots (%u frames) in %zu/%zu bytes, mean delta %llu bytes of %zu\n",
+			g_rewind.count, g_rewind.count * g_rewind.interval, g_rewind.used, g_rewind.capacity,
+			(unsigned long long)(g_rewind.pushed_bytes / g_rewind.pushed), g_rewind.size);
+
+	free(g_rewind.ring);
+	free(g_rewind.current);
+	free(g_rewind.scratch);
+	free(g_rewind.delta);
+	g_rewind.ring = g_rewind.delta = NULL;
+	g_rewind.current = g_rewind.scratch = NULL;
+	g_rewind.pushed = 0;
+}
+
+
+static void rewind_ring_write(size_t pos, const void *src, size_t len) {
+	size_t first = g_rewind.capacity - pos < len ? g_rewind.capacity - pos : len;
+
+	memcpy(g_rewind.ring + pos, src, first);
+	memcpy(g_rewind.ring, (const uint8_t *)src + first, len - first);
+}
+
+
+static void rewind_ring_read(size_t pos, void *dst, size_t len) {
+	size_t first = g_rewind.capacity - pos < len ? g_rewind.capacity - pos : len;
+
+	memcpy(dst, g_rewind.ring + pos, first);
+	memcpy((uint8_t *)dst + first, g_rewind.ring, len - first);
+}
+
+
+// Encodes a ^ b as (u32 equal words, u32 literal words, literal words...) runs.
+static size_t rewind_encode(const uint64_t *a, const uint64_t *b, size_t n, uint8_t *out) {
+	uint8_t *p = out;
+	size_t i = 0;
+
+	while (i < n) {
+		uint32_t zeros, literals;
+		size_t start = i;
+
+		while (i < n && a[i] == b[i])
+			i++;
+
+		zeros = i - start;
+		start = i;
+
+		// Literal runs only end at two equal words, so every header is paid
+		// for and the encoding never exceeds 1.5 times the state size.
+		while (i < n && !(a[i] == b[i] && (i + 1 == n || a[i + 1] == b[i + 1])))
+			i++;
+
+		literals = i - start;
+
+		memcpy(p, &zeros, 4);
+		memcpy(p + 4, &literals, 4);
+		p += 8;
+
+		for (; start < i; ++start, p += 8) {
+			uint64_t x = a[start] ^ b[start];
+			memcpy(p, &x, 8);
+		}
+	}
+
+	return p - out;
+}
+
+
+static void rewind_apply(uint64_t *dst, const uint8_t *in, size_t len) {
+	const uint8_t *end = in + len;
+	size_t w = 0;
+
+	while (in < end) {
+		uint32_t zeros, literals;
+
+		memcpy(&zeros, in, 4);
+		memcpy(&literals, in + 4, 4);
+		in += 8;
+		w += zeros;
+
+		for (; literals; --literals, ++w, in += 8) {
+			uint64_t x;
+			memcpy(&x, in, 8);
+			dst[w] ^= x;
+		}
 	}
-	case RETRO_ENVIRONMENT_GET_CAN_DUPE:
-		bval = (bool*)data;
-		*bval = true;
-		break;
-	case RETRO_ENVIRONMENT_SET_PIXEL_FORMAT: {
-		const enum retro_pixel_format *fmt = (enum retro_pixel_format *)data;
+}
 
-		if (*fmt > RETRO_PIXEL_FORMAT_RGB565)
-			return false;
 
-		return video_set_pixel_format(*fmt);
+static void rewind_evict() {
+	uint32_t len;
+
+	rewind_ring_read(g_rewind.head, &len, 4);
+	g_rewind.head = (g_rewind.head + len + 8) % g_rewind.capacity;
+	g_rewind.used -= len + 8;
+	g_rewind.count--;
+}
+
+
+static void rewind_push() {
+	uint32_t len;
+	uint64_t *tmp;
+
+	if (!g_rewind.ring || --g_rewind.countdown)
+		return;
+
+	g_rewind.countdown = g_rewind.interval;
+
+	if (!g_retro.retro_serialize(g_rewind.scratch, g_rewind.size))
+		return;
+
+	if (g_rewind.primed) {
+		len = rewind_encode(g_rewind.scratch, g_rewind.current, g_rewind.words, g_rewind.delta);
+
+		if (len + 8 > g_rewind.capacity) {
+			fprintf(stderr, "A %u byte rewind snapshot doesn't fit the buffer, rewind disabled\n", len);
+			rewind_deinit();
+			return;
+		}
+
+		while (g_rewind.capacity - g_rewind.used < len + 8)
+			rewind_evict();
+
+		size_t tail = (g_rewind.head + g_rewind.used) % g_rewind.capacity;
+		rewind_ring_write(tail, &len, 4);
+		rewind_ring_write((tail + 4) % g_rewind.capacity, g_rewind.delta, len);
+		rewind_ring_write((tail + 4 + len) % g_rewind.capacity, &len, 4);
+
+		g_rewind.used += len + 8;
+		g_rewind.count++;
+		g_rewind.pushed++;
+		g_rewind.pushed_bytes += len;
 	}
-	case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
-	case RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY:
-		*(const char **)data = ".";
-		return true;
 
-	default:
-		core_log(RETRO_LOG_DEBUG, "Unhandled env #%u", cmd);
+	tmp = g_rewind.current;
+	g_rewind.current = g_rewind.scratch;
+	g_rewind.scratch = tmp;
+	g_rewind.primed = true;
+}
+
+
+// Steps back to the previous snapshot, returns false when history runs out.
+static bool rewind_pop() {
+	size_t tail;
+	uint32_t len;
+
+	if (!g_rewind.ring || !g_rewind.count)
 		return false;
-	}
+
+	tail = (g_rewind.head + g_rewind.used) % g_rewind.capacity;
+	rewind_ring_read((tail + g_rewind.capacity - 4) % g_rewind.capacity, &len, 4);
+	rewind_ring_read((tail + g_rewind.capacity - 4 - len) % g_rewind.capacity, g_rewind.delta, len);
+	rewind_apply(g_rewind.current, g_rewind.delta, len);
+
+	g_rewind.used -= len + 8;
+	g_rewind.count--;
+	g_rewind.countdown = g_rewind.interval;
+
+	if (!g_retro.retro_unserialize(g_rewind.current, g_rewind.size))
+		die("Failed to rewind, core returned error");
 
 	return true;
 }
 
 
-static void core_video_refresh(const void *data, unsigned width, unsigned height, size_t pitch) {
-	if (data)
-		video_refresh(data, width, height, pitch);
+// Calls retro_run, telling the core how much time passed since the last
+// frame. Hidden frames don't correspond to any real time passing.
+static void core_run(bool hidden) {
+	retro_usec_t delta;
+	uint64_t now;
+
+	if (g_frame_time.cb.callback) {
+		now = time_ns();
+		delta = g_frame_time.cb.reference;
+
+		if (atomic_exchange(&g_frame_time.resync, false))
+			g_frame_time.last = 0;
+
+		if (!hidden) {
+			if (g_frame_time.last && !g_frame_time.fixed &&
+					!atomic_load_explicit(&g_ff.active, memory_order_relaxed))
+				delta = (now - g_frame_time.last) / 1000;
+
+			g_frame_time.last = now;
+		}
+
+		g_frame_time.cb.callback(delta);
+	}
+
+	g_retro.retro_run();
+
+	audio_flush();
+	g_audio_stats.frames++;
 }
 
 
-static void core_input_poll(void) {
-	int i;
-	for (i = 0; g_binds[i].k || g_binds[i].rk; ++i)
-		g_joy[g_binds[i].rk] = (glfwGetKey(g_win, g_binds[i].k) == GLFW_PRESS);
+// Runs one frame of emulation, ahead of the real one if run-ahead is enabled,
+// or steps back through the rewind buffer.
+static void run_frame(bool rewind) {
+	bool video = g_video_suppressed, audio = g_audio_suppressed;
+	unsigned i;
+
+	if (rewind) {
+		g_frame_time.rewinding = true;
+
+		if (rewind_pop()) {
+			g_audio_suppressed = true;
+			core_run(false);
+			g_audio_suppressed = audio;
+		}
+
+		return;
+	}
+
+	if (g_frame_time.rewinding) {
+		g_frame_time.rewinding = false;
+		g_frame_time.last = 0;
+	}
+
+	atomic_fetch_add(&g_frames_run, 1);
+
+	if (!g_runahead.frames) {
+		core_run(false);
+		rewind_push();
+		return;
+	}
+
+	// The real frame plays its audio, but its video is superseded.
+	g_video_suppressed = true;
+	core_run(false);
+	g_video_suppressed = video;
+
+	if (!g_retro.retro_serialize(g_runahead.state, g_runahead.size)) {
+		fprintf(stderr, "Failed to save state, run-ahead disabled\n");
+		g_runahead.frames = 0;
+		return;
+	}
 
-	// Quit nanoarch when pressing the Escape key.
-	if (glfwGetKey(g_win, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-		glfwSetWindowShouldClose(g_win, true);
+	g_audio_suppressed = true;
+
+	for (i = 1; i <= g_runahead.frames; ++i) {
+		g_video_suppressed = video || i < g_runahead.frames;
+		core_run(true);
 	}
+
+	g_audio_suppressed = audio;
+	g_video_suppressed = video;
+
+	if (!g_retro.retro_unserialize(g_runahead.state, g_runahead.size))
+		die("Failed to roll back run-ahead frames, core returned error");
+
+	rewind_push();
 }
 
 
-static int16_t core_input_state(unsigned port, unsigned device, unsigned index, unsigned id) {
-	if (port || index || device != RETRO_DEVICE_JOYPAD)
-		return 0;
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+// Runs the core unthrottled for a fixed number of frames and reports timings.
+static void run_benchmark(unsigned frames) {
+	uint64_t *times = malloc(frames * sizeof(*times));
+	uint64_t start, total, sum = 0;
+	unsigned i;
+
+	if (!times)
+		die("Failed to allocate benchmark buffer");
 
-	return g_joy[id];
+	g_frame_time.fixed = true;
+
+	// Frames are presented too, as fast as the backend takes them.
+	g_video_backend->set_vsync(false);
+
+	start = time_ns();
+
+	for (i = 0; i < frames; ++i) {
+		uint64_t t = time_ns();
+		run_frame(false);
+		g_video_backend->render();
+		times[i] = time_ns() - t;
+		sum += times[i];
+	}
+
+	total = time_ns() - start;
+
+	qsort(times, frames, sizeof(*times), compare_u64);
+
+	printf("Benchmark: %u frames in %.3f s\n", frames, total / 1e9);
+	printf("  fps:  %.2f\n", frames / (total / 1e9));
+	printf("  mean: %.3f ms\n", sum / 1e6 / frames);
+	printf("  p50:  %.3f ms\n", times[frames / 2] / 1e6);
+	printf("  p99:  %.3f ms\n", times[(frames - 1) * 99 / 100] / 1e6);
+
+	free(times);
 }
 
 
-static void core_audio_sample(int16_t left, int16_t right) {
-	int16_t buf[2] = {left, right};
-	audio_write(buf, 1);
+static void fast_forward_init() {
+	double hz = g_video_backend->refresh_rate();
+
+	g_ff.period = hz > 0 ? 1e9 / hz : 0;
+
+	if (atomic_load(&g_ff.active) && !g_threaded)
+		g_video_backend->set_vsync(false);
 }
 
 
-static size_t core_audio_sample_batch(const int16_t *data, size_t frames) {
-	return audio_write(data, frames);
+static void pause_toggle() {
+	atomic_store(&g_paused, !atomic_load(&g_paused));
+	atomic_store(&g_frame_time.resync, true);
 }
 
 
-static void core_load(const char *sofile) {
-	void (*set_environment)(retro_environment_t) = NULL;
-	void (*set_video_refresh)(retro_video_refresh_t) = NULL;
-	void (*set_input_poll)(retro_input_poll_t) = NULL;
-	void (*set_input_state)(retro_input_state_t) = NULL;
-	void (*set_audio_sample)(retro_audio_sample_t) = NULL;
-	void (*set_audio_sample_batch)(retro_audio_sample_batch_t) = NULL;
+static void fast_forward_toggle() {
+	bool active = !atomic_load(&g_ff.active);
 
-	memset(&g_retro, 0, sizeof(g_retro));
-	g_retro.handle = dlopen(sofile, RTLD_LAZY);
+	atomic_store(&g_ff.active, active);
 
-	if (!g_retro.handle)
-		die("Failed to load core: %s", dlerror());
+	// The presenter thread keeps vsync, it only ever shows the newest frame.
+	if (!g_threaded)
+		g_video_backend->set_vsync(!active);
+}
 
-	dlerror();
 
-	load_retro_sym(retro_init);
-	load_retro_sym(retro_deinit);
-	load_retro_sym(retro_api_version);
-	load_retro_sym(retro_get_system_info);
-	load_retro_sym(retro_get_system_av_info);
-	load_retro_sym(retro_set_controller_port_device);
-	load_retro_sym(retro_reset);
-	load_retro_sym(retro_run);
-	load_retro_sym(retro_load_game);
-	load_retro_sym(retro_unload_game);
-	load_retro_sym(retro_serialize_size);
-	load_retro_sym(retro_serialize);
-	load_retro_sym(retro_unserialize);
+// Decides whether the next frame is uploaded and presented, and whether its
+// audio is played.
+static void fast_forward_frame() {
+	uint64_t now;
 
-	load_sym(set_environment, retro_set_environment);
-	load_sym(set_video_refresh, retro_set_video_refresh);
-	load_sym(set_input_poll, retro_set_input_poll);
-	load_sym(set_input_state, retro_set_input_state);
-	load_sym(set_audio_sample, retro_set_audio_sample);
-	load_sym(set_audio_sample_batch, retro_set_audio_sample_batch);
+	g_audio_suppressed = atomic_load_explicit(&g_ff.active, memory_order_relaxed);
+	g_video_suppressed = false;
 
-	set_environment(core_environment);
-	set_video_refresh(core_video_refresh);
-	set_input_poll(core_input_poll);
-	set_input_state(core_input_state);
-	set_audio_sample(core_audio_sample);
-	set_audio_sample_batch(core_audio_sample_batch);
+	if (!g_audio_suppressed)
+		return;
 
-	g_retro.retro_init();
-	g_retro.initialized = true;
+	if (g_ff.skip) {
+		g_video_suppressed = ++g_ff.frames % g_ff.skip != 0;
+	} else if (g_ff.period) {
+		now = time_ns();
+		g_video_suppressed = now - g_ff.last_present < g_ff.period;
 
-	puts("Core loaded");
+		if (!g_video_suppressed)
+			g_ff.last_present = now;
+	}
 }
 
 
-static void core_load_game(const char *filename) {
-	struct retro_system_av_info av = {0};
-	struct retro_system_info system = {0};
-	struct retro_game_info info = { filename, 0 };
-	FILE *file = fopen(filename, "rb");
+static void frame_delay_init() {
+	double hz = g_video_backend->refresh_rate();
 
-	if (!file)
-		goto libc_error;
+	if (!g_frame_delay.enabled)
+		return;
 
-	fseek(file, 0, SEEK_END);
-	info.size = ftell(file);
-	rewind(file);
+	if (g_threaded || g_pace.source == PACE_AUDIO || g_pace.source == PACE_NONE) {
+		fprintf(stderr, "Frame delay needs single-threaded video and vsync or timer pacing, disabling it\n");
+		g_frame_delay.enabled = false;
+		return;
+	}
 
-	g_retro.retro_get_system_info(&system);
+	g_frame_delay.period = g_pace.source == PACE_VSYNC && hz > 0 ? 1e9 / hz : g_pace.period;
 
-	if (!system.need_fullpath) {
-		info.data = malloc(info.size);
+	if (!g_frame_delay.automatic && g_frame_delay.delay + FRAME_DELAY_MARGIN_NS > g_frame_delay.period) {
+		g_frame_delay.delay = g_frame_delay.period > FRAME_DELAY_MARGIN_NS ? g_frame_delay.period - FRAME_DELAY_MARGIN_NS : 0;
+		fprintf(stderr, "Frame delay limited to %.1f ms\n", g_frame_delay.delay / 1e6);
+	}
+}
 
-		if (!info.data || !fread((void*)info.data, info.size, 1, file))
-			goto libc_error;
+
+// Sleeps until the delay after the previous present has passed.
+static void frame_delay_wait() {
+	uint64_t wake = g_frame_delay.present + g_frame_delay.delay;
+	struct timespec ts = { wake / 1000000000ull, wake % 1000000000ull };
+
+	if (!g_frame_delay.enabled)
+		return;
+
+	if (g_frame_delay.present && !atomic_load_explicit(&g_ff.active, memory_order_relaxed) && !atomic_load(&g_paused))
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+	g_frame_delay.woke = time_ns();
+}
+
+
+// Called once the frame is ready to present, to measure what it cost.
+static void frame_delay_ran() {
+	uint64_t cost = time_ns() - g_frame_delay.woke;
+
+	if (!g_frame_delay.enabled)
+		return;
+
+	if (cost > g_frame_delay.cost_max)
+		g_frame_delay.cost_max = cost;
+
+	if (++g_frame_delay.window == FRAME_DELAY_WINDOW) {
+		g_frame_delay.cost_prev = g_frame_delay.cost_max;
+		g_frame_delay.cost_max = 0;
+		g_frame_delay.window = 0;
 	}
+}
 
-	if (!g_retro.retro_load_game(&info))
-		die("The core failed to load the content.");
 
-	g_retro.retro_get_system_av_info(&av);
+// Called after the frame was presented. Presenting a quarter period late
+// means the deadline was missed.
+static void frame_delay_presented() {
+	uint64_t now = time_ns(), cost, reserve;
 
-	video_configure(&av.geometry);
-	audio_init(av.timing.sample_rate);
+	if (!g_frame_delay.enabled)
+		return;
 
-	return;
+	if (g_frame_delay.present && now - g_frame_delay.present > g_frame_delay.period + g_frame_delay.period / 4 &&
+			!atomic_load_explicit(&g_ff.active, memory_order_relaxed) && !atomic_load(&g_paused)) {
+		g_frame_delay.misses++;
+		g_frame_delay.backoff += g_frame_delay.period / 16;
+		g_frame_delay.clean = 0;
+	} else if (++g_frame_delay.clean >= 4 * FRAME_DELAY_WINDOW && g_frame_delay.backoff) {
+		// Creep back once things have been stable for a while.
+		g_frame_delay.backoff -= g_frame_delay.backoff < g_frame_delay.period / 64 ? g_frame_delay.backoff : g_frame_delay.period / 64;
+		g_frame_delay.clean = 0;
+	}
 
-libc_error:
-	die("Failed to load content '%s': %s", filename, strerror(errno));
+	g_frame_delay.present = now;
+	g_frame_delay.frames++;
+	g_frame_delay.delay_sum += g_frame_delay.delay;
+
+	// The automatic mode starts without delay until it has seen a full window.
+	if (!g_frame_delay.automatic || !g_frame_delay.cost_prev)
+		return;
+
+	cost = g_frame_delay.cost_max > g_frame_delay.cost_prev ? g_frame_delay.cost_max : g_frame_delay.cost_prev;
+	reserve = cost + cost / 4 + FRAME_DELAY_MARGIN_NS + g_frame_delay.backoff;
+	g_frame_delay.delay = g_frame_delay.period > reserve ? g_frame_delay.period - reserve : 0;
 }
 
 
-static void core_unload() {
-	if (g_retro.initialized)
-		g_retro.retro_deinit();
+static void frame_delay_deinit() {
+	if (!g_frame_delay.frames)
+		return;
 
-	if (g_retro.handle)
-		dlclose(g_retro.handle);
+	fprintf(stderr, "Frame delay%s: mean %.2f ms, %u missed deadlines\n", g_frame_delay.automatic ? " (auto)" : "",
+		g_frame_delay.delay_sum / 1e6 / g_frame_delay.frames, g_frame_delay.misses);
+}
+
+
+static void interrupt_cb(int sig) {
+	atomic_store(&g_interrupted, true);
+}
+
+
+static unsigned pump_hotkeys() {
+	unsigned hotkeys = g_input_backend->pump();
+
+	if (atomic_load(&g_interrupted) || (g_frame_limit && atomic_load(&g_frames_run) >= g_frame_limit))
+		hotkeys |= HOTKEY_QUIT;
+
+	return hotkeys;
+}
+
+
+static void run_loop() {
+	unsigned held = 0;
+
+	for (;;) {
+		frame_delay_wait();
+
+		unsigned hotkeys = pump_hotkeys();
+		unsigned pressed = hotkeys & ~held;
+
+		held = hotkeys;
+
+		if (hotkeys & HOTKEY_QUIT)
+			break;
+
+		if (hotkeys & HOTKEY_RESET)
+			g_retro.retro_reset();
+
+		if (pressed & HOTKEY_FAST_FORWARD)
+			fast_forward_toggle();
+
+		if (pressed & HOTKEY_PAUSE)
+			pause_toggle();
+
+		if (!atomic_load(&g_paused)) {
+			fast_forward_frame();
+			run_frame(hotkeys & HOTKEY_REWIND);
+		}
+
+		frame_delay_ran();
+
+		if (!g_video_suppressed) {
+			g_video_backend->render();
+			latency_advance(LATENCY_UPLOADED, 0, 0);
+		}
+
+		pace_wait();
+		frame_delay_presented();
+	}
+}
+
+
+// Runs the core at its own frame rate, independently of the presenter.
+static void *emulation_thread(void *arg) {
+	while (!atomic_load(&g_emu.quit)) {
+		if (atomic_exchange(&g_emu.reset, false))
+			g_retro.retro_reset();
+
+		if (!atomic_load(&g_paused)) {
+			fast_forward_frame();
+			run_frame(atomic_load(&g_emu.rewind));
+		}
+
+		pace_wait();
+	}
+
+	return NULL;
+}
+
+
+// Uploads and presents only the newest frame the emulation thread finished.
+static void run_threaded() {
+	if (pthread_create(&g_emu.thread, NULL, emulation_thread, NULL))
+		die("Failed to create the emulation thread");
+
+	unsigned held = 0;
+
+	for (;;) {
+		unsigned hotkeys = pump_hotkeys();
+		unsigned pressed = hotkeys & ~held;
+		struct frame *f;
+
+		held = hotkeys;
+
+		if (hotkeys & HOTKEY_QUIT)
+			break;
+
+		if (pressed & HOTKEY_FAST_FORWARD)
+			fast_forward_toggle();
+
+		if (pressed & HOTKEY_PAUSE)
+			pause_toggle();
+
+		if (hotkeys & HOTKEY_RESET)
+			atomic_store(&g_emu.reset, true);
+
+		atomic_store(&g_emu.rewind, hotkeys & HOTKEY_REWIND);
+
+		if (!(f = frames_acquire())) {
+			struct timespec ts = { 0, 1000000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		g_video_backend->refresh(f->data, f->width, f->height, f->pitch);
+		g_video_backend->render();
+	}
+
+	atomic_store(&g_emu.quit, true);
+	pthread_join(g_emu.thread, NULL);
+	frames_deinit();
 }
 
 
 int main(int argc, char *argv[]) {
-	if (argc < 3)
-		die("usage: %s <core> <game> [-s default-scale] [-l load-savestate] [-d save-savestate]", argv[0]);
+	if (argc == 2 && !strcmp(argv[1], "--bench-pixconv")) {
+		pixconv_benchmark();
+		return EXIT_SUCCESS;
+	}
 
-	if (!glfwInit())
-		die("Failed to initialize glfw");
+	if (argc < 3)
+		die("usage: %s --bench-pixconv | <core> <game> [-s default-scale] [-l load-savestate] [-d save-savestate] [--bench frames] [--frames count] [--screenshot file.ppm]"
+			" [--video gl|egl|null] [--audio alsa|alsa-mmap|file|null] [--input glfw|null] [--gamepad auto|path] [--threaded]"
+			" [--pace vsync|timer|audio|none] [--frame-delay ms|auto] [--latency] [--runahead frames]"
+			" [--rewind megabytes] [--rewind-interval frames] [--fast-forward] [--ff-skip frames]"
+			" [--slow-motion factor] [--audio-async] [--drc on|off]"
+			" [--audio-buffer usec] [--audio-period usec] [--audio-file path] [--pbo on|off]"
+			" [--frame-diff on|off] [--skip-present]", argv[0]);
 
 	char **opts = &argv[3];
 	char *savestatel = NULL;
 	char *savestated = NULL;
+	const char *screenshot = NULL;
+	unsigned bench_frames = 0;
+	const char *pace = NULL;
 	while (*opts) {
 		if (!strcmp(*opts, "-s"))
 			g_scale = atoi(*(++opts));
@@ -538,11 +4221,105 @@ int main(int argc, char *argv[]) {
 			savestatel = *(++opts);
 		else if (!strcmp(*opts, "-d"))
 			savestated = *(++opts);
+		else if (!strcmp(*opts, "--frames"))
+			g_frame_limit = strtoul(*(++opts), NULL, 10);
+		else if (!strcmp(*opts, "--screenshot"))
+			screenshot = *(++opts);
+		else if (!strcmp(*opts, "--bench"))
+			bench_frames = strtoul(*(++opts), NULL, 10);
+		else if (!strcmp(*opts, "--threaded"))
+			g_threaded = true;
+		else if (!strcmp(*opts, "--pace"))
+			pace = *(++opts);
+		else if (!strcmp(*opts, "--frame-delay")) {
+			const char *delay = *(++opts);
+			g_frame_delay.enabled = true;
+			g_frame_delay.automatic = !strcmp(delay, "auto");
+			g_frame_delay.delay = g_frame_delay.automatic ? 0 : atof(delay) * 1e6;
+		} else if (!strcmp(*opts, "--latency"))
+			g_latency.enabled = true;
+		else if (!strcmp(*opts, "--runahead"))
+			g_runahead.frames = strtoul(*(++opts), NULL, 10);
+		else if (!strcmp(*opts, "--rewind"))
+			g_rewind.capacity = strtoul(*(++opts), NULL, 10) << 20;
+		else if (!strcmp(*opts, "--rewind-interval"))
+			g_rewind.interval = strtoul(*(++opts), NULL, 10);
+		else if (!strcmp(*opts, "--fast-forward"))
+			atomic_store(&g_ff.active, true);
+		else if (!strcmp(*opts, "--ff-skip"))
+			g_ff.skip = strtoul(*(++opts), NULL, 10);
+		else if (!strcmp(*opts, "--slow-motion"))
+			g_slowmo = atof(*(++opts));
+		else if (!strcmp(*opts, "--audio-async"))
+			g_audio_async.enabled = true;
+		else if (!strcmp(*opts, "--frame-diff"))
+			g_video.diff_enabled = strcmp(*(++opts), "off");
+		else if (!strcmp(*opts, "--skip-present"))
+			g_video.skip_present = true;
+		else if (!strcmp(*opts, "--pbo"))
+			g_video.pbo_enabled = strcmp(*(++opts), "off");
+		else if (!strcmp(*opts, "--drc"))
+			g_drc.enabled = strcmp(*(++opts), "off");
+		else if (!strcmp(*opts, "--audio-buffer"))
+			g_pcm_buffer_us = strtoul(*(++opts), NULL, 10);
+		else if (!strcmp(*opts, "--audio-period"))
+			g_pcm_period_us = strtoul(*(++opts), NULL, 10);
+		else if (!strcmp(*opts, "--gamepad")) {
+			if (g_gamepad.npaths == MAX_PORTS)
+				die("At most %d gamepads are supported", MAX_PORTS);
+			g_gamepad.paths[g_gamepad.npaths++] = *(++opts);
+		} else if (!strcmp(*opts, "--audio-file"))
+			g_audio_file.path = *(++opts);
+		else if (!strcmp(*opts, "--video"))
+			g_video_backend = find_video_backend(*(++opts));
+		else if (!strcmp(*opts, "--audio"))
+			g_audio_backend = find_audio_backend(*(++opts));
+		else if (!strcmp(*opts, "--input"))
+			g_input_backend = find_input_backend(*(++opts));
 		opts++;
 	}
 
+	g_threaded = g_threaded && !bench_frames;
+
+	// Stages are tracked without locks, on the thread that runs the core.
+	if (g_latency.enabled && g_threaded) {
+		fprintf(stderr, "Latency measurement needs single-threaded mode, disabling it\n");
+		g_latency.enabled = false;
+	}
+
+	if (g_slowmo <= 0)
+		die("The slow-motion factor must be positive");
+
+	// Benchmarks run headless unless a backend was picked explicitly.
+	if (!g_video_backend)
+		g_video_backend = bench_frames ? &video_null : &video_gl;
+	if (!g_audio_backend)
+		g_audio_backend = bench_frames ? &audio_null : &audio_alsa;
+	if (!g_input_backend)
+		g_input_backend = g_video_backend == &video_gl ? &input_glfw : &input_null;
+
+	g_pace.automatic = !pace;
+
+	if (pace)
+		g_pace.source = find_pace_source(pace);
+	else
+		g_pace.source = g_video_backend == &video_gl ? PACE_VSYNC :
+				g_video_backend == &video_egl ? PACE_NONE : PACE_TIMER;
+
+	g_video_backend->init();
+
 	core_load(argv[1]);
 	core_load_game(argv[2]);
+	g_input_backend->init();
+	gamepad_init();
+	pace_init(g_av.timing.fps);
+	drc_init();
+	runahead_init();
+	rewind_init();
+	fast_forward_init();
+	frame_delay_init();
+	audio_async_init(g_av.timing.sample_rate);
+	audio_callback_init();
 
 	if (savestatel) {
 		FILE *fd = fopen(savestatel, "rb");
@@ -558,22 +4335,18 @@ int main(int argc, char *argv[]) {
 		free(saveblob);
 	}
 
-	while (!glfwWindowShouldClose(g_win)) {
-		glfwPollEvents();
+	signal(SIGINT, interrupt_cb);
+	signal(SIGTERM, interrupt_cb);
 
-		// Reset core on R key.
-		if (glfwGetKey(g_win, GLFW_KEY_R) == GLFW_PRESS) {
-			g_retro.retro_reset();
-		}
-
-		g_retro.retro_run();
-
-		glClear(GL_COLOR_BUFFER_BIT);
-
-		video_render();
+	if (bench_frames)
+		run_benchmark(bench_frames);
+	else if (g_threaded)
+		run_threaded();
+	else
+		run_loop();
 
-		glfwSwapBuffers(g_win);
-	}
+	if (screenshot && !g_video_backend->screenshot(screenshot))
+		fprintf(stderr, "Failed to save a screenshot to '%s'\n", screenshot);
 
 	if (savestated) {
 		FILE *fd = fopen(savestated, "wb");
@@ -592,10 +4365,20 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	audio_callback_deinit();
+	audio_async_deinit();
+	audio_stats_print();
+	drc_deinit();
+	pace_deinit();
+	frame_delay_deinit();
+	latency_print();
+	runahead_deinit();
+	rewind_deinit();
 	core_unload();
-	audio_deinit();
-	video_deinit();
+	gamepad_deinit();
+	g_input_backend->deinit();
+	g_audio_backend->deinit();
+	g_video_backend->deinit();
 
-	glfwTerminate();
 	return 0;
 }
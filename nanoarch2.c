@@ -5,11 +5,15 @@
 #include <string.h>
 #include <errno.h>
 #include "libretro.h"
+#include "pixconv.h"
 #include <alsa/asoundlib.h>
 #include <signal.h>
 
 #define LOG_LEVEL RETRO_LOG_INFO
 
+// number of stereo frames staged by cb_audio_sample before writing to the device
+#define AUDIO_BATCH_FRAMES 1024
+
 #define fatal(msg, ...)                      \
     {                                        \
         fprintf(stderr, "FATAL: ");          \
@@ -33,6 +37,19 @@ struct g_app
     // used to play sound
     snd_pcm_t *pcm;
 
+    // samples from cb_audio_sample, flushed once per frame
+    int16_t audio_batch[AUDIO_BATCH_FRAMES * 2];
+    unsigned audio_batch_frames;
+
+    // how many times the device was written to, and over how many frames
+    unsigned long audio_writes;
+    unsigned long frames;
+
+    // converts frames from the core's pixel format into XRGB8888
+    pixconv_fn convert;
+    uint32_t *frame;
+    size_t frame_size;
+
     // indicates the state of each button in the retropad
     unsigned joypad[RETRO_DEVICE_ID_JOYPAD_L3 + 1];
 
@@ -63,6 +80,11 @@ void shutdown(int status)
     if (g.pcm)
         snd_pcm_close(g.pcm);
 
+    free(g.frame);
+
+    if (g.frames)
+        fprintf(stderr, "audio: %.2f device writes per frame\n", (double)g.audio_writes / g.frames);
+
     if (g.retro_unload_game)
         g.retro_unload_game();
 
@@ -103,9 +125,21 @@ bool cb_environment(unsigned cmd, void *data)
         cb->log = core_log;
         return true;
 
-    // disallow setting pixel format
     case RETRO_ENVIRONMENT_SET_PIXEL_FORMAT:
-        return false;
+        switch (*(enum retro_pixel_format *)data)
+        {
+        case RETRO_PIXEL_FORMAT_0RGB1555:
+            g.convert = pixconv_get(PIXCONV_0RGB1555_TO_XRGB8888, NULL);
+            return true;
+        case RETRO_PIXEL_FORMAT_RGB565:
+            g.convert = pixconv_get(PIXCONV_RGB565_TO_XRGB8888, NULL);
+            return true;
+        case RETRO_PIXEL_FORMAT_XRGB8888:
+            g.convert = pixconv_get(PIXCONV_REPACK32, NULL);
+            return true;
+        default:
+            return false;
+        }
 
     case RETRO_ENVIRONMENT_GET_CAN_DUPE:
         *(bool *)data = true;
@@ -141,18 +175,31 @@ struct color colors[] = {
     {-1, -1},
 };
 
-// Currently only supports 0RGB155 pixel format, where each pixel contains 16 bit of information:
-// ARRRRRGGGGGBBBBB
-// A (alpha):  0 = transparent, 1 = opaque
-// R (red): 5 bit unsigned number, representing the intensity of red (0 = no red, 31 = max red)
-// G (green): same idea as R
-// B (blue): same idea as R
+// Every frame is first converted to XRGB8888 (one pixel per uint32_t, 0xFFRRGGBB),
+// whatever format the core uses, and with the core's pitch removed.
+// The terminal only has 8 colors, so each channel is reduced to its top bit.
 void cb_video_refresh(const void *data, unsigned width, unsigned height, size_t pitch)
 {
     if (!data)
         return;
 
-    uint16_t *pixels = (uint16_t *)data;
+    // cores that never set a pixel format use 0RGB1555
+    if (!g.convert)
+        g.convert = pixconv_get(PIXCONV_0RGB1555_TO_XRGB8888, NULL);
+
+    if (g.frame_size < (size_t)width * height)
+    {
+        free(g.frame);
+        g.frame = malloc((size_t)width * height * sizeof(uint32_t));
+        if (!g.frame)
+        {
+            fatal("failed to allocate the frame buffer");
+        }
+        g.frame_size = (size_t)width * height;
+    }
+
+    g.convert(g.frame, width * sizeof(uint32_t), data, pitch, width, height);
+    uint32_t *pixels = g.frame;
 
     start_color();
 
@@ -169,23 +216,10 @@ void cb_video_refresh(const void *data, unsigned width, unsigned height, size_t
         unsigned w = (i - skip) % width / step;
         unsigned h = (i - skip) / width / step;
 
-        uint16_t a = (pixels[i] >> 14) & 1;
-        // alpha = 0, draw transparent block
-        if (!a)
-        {
-            mvprintw(h, w, " ");
-            continue;
-        }
-
-        // just taking the bits from 0RGB1555 as explained before
-        uint16_t red = (pixels[i] >> 9) & 0x1F;
-        uint16_t green = (pixels[i] >> 6) & 0x1F;
-        uint16_t blue = pixels[i] & 0x1F;
-
-        // divide by 16 so values in range [0, 15] become 0 and values in range [16, 31] become 1
-        short bits = (red / 16 % 2) << 2;
-        bits |= (green / 16 % 2) << 1;
-        bits |= blue / 16 % 2;
+        // values in range [0, 127] become 0 and values in range [128, 255] become 1
+        short bits = (pixels[i] >> 23 & 1) << 2;
+        bits |= (pixels[i] >> 15 & 1) << 1;
+        bits |= pixels[i] >> 7 & 1;
 
         struct color clr = {-1, -1};
         for (int i = 0; colors[i].bits >= 0; i++)
@@ -218,11 +252,13 @@ void cb_video_refresh(const void *data, unsigned width, unsigned height, size_t
     refresh();
 }
 
-size_t cb_audio_sample_batch(const int16_t *data, size_t frames)
+size_t audio_write(const int16_t *data, size_t frames)
 {
     if (!g.pcm)
         return 0;
 
+    g.audio_writes++;
+
     int n = snd_pcm_writei(g.pcm, data, frames);
     if (n < 0)
     {
@@ -233,10 +269,31 @@ size_t cb_audio_sample_batch(const int16_t *data, size_t frames)
     return n;
 }
 
+// writes out whatever cb_audio_sample staged
+void audio_flush(void)
+{
+    if (g.audio_batch_frames)
+        audio_write(g.audio_batch, g.audio_batch_frames);
+
+    g.audio_batch_frames = 0;
+}
+
+size_t cb_audio_sample_batch(const int16_t *data, size_t frames)
+{
+    // keep ordering with samples staged earlier in the frame
+    audio_flush();
+
+    return audio_write(data, frames);
+}
+
+// single samples are staged instead of costing a device write each
 void cb_audio_sample(int16_t left, int16_t right)
 {
-    int16_t buf[2] = {left, right};
-    cb_audio_sample_batch(buf, 1);
+    g.audio_batch[g.audio_batch_frames * 2] = left;
+    g.audio_batch[g.audio_batch_frames * 2 + 1] = right;
+
+    if (++g.audio_batch_frames == AUDIO_BATCH_FRAMES)
+        audio_flush();
 }
 
 // input poll captures and stores input state
@@ -395,7 +452,11 @@ int main(int argc, char *argv[])
 
     // main loop
     for (;;)
+    {
         g.retro_run();
+        audio_flush();
+        g.frames++;
+    }
 
     shutdown(0);
 }
\ No newline at end of file
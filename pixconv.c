@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pixconv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXCONV_X86
+#include <immintrin.h>
+#endif
+
+const char *pixconv_kind_names[PIXCONV_KINDS] = {
+	"0RGB1555 -> XRGB8888",
+	"RGB565 -> XRGB8888",
+	"XRGB8888 -> RGB565",
+	"repack 16-bit",
+	"repack 32-bit",
+};
+
+const char *pixconv_isa_names[PIXCONV_ISAS] = { "scalar", "sse2", "avx2" };
+
+// Bytes per pixel read and written by each kind.
+static const unsigned g_src_bpp[PIXCONV_KINDS] = { 2, 2, 4, 2, 4 };
+static const unsigned g_dst_bpp[PIXCONV_KINDS] = { 4, 4, 2, 2, 4 };
+
+// Every kernel converts row by row with one of these.
+#define KERNEL(name, row) \
+	static void name(void *dst, size_t dst_pitch, const void *src, size_t src_pitch, unsigned width, unsigned height) { \
+		unsigned y; \
+		for (y = 0; y < height; ++y) \
+			row((uint8_t *)dst + y * dst_pitch, (const uint8_t *)src + y * src_pitch, width); \
+	}
+
+
+// 5 and 6 bit channels are widened by repeating their top bits, so full
+// intensity stays full intensity. The X byte is set, making the output
+// usable as opaque ARGB as well.
+static inline uint32_t expand5(uint32_t v) { return v << 3 | v >> 2; }
+static inline uint32_t expand6(uint32_t v) { return v << 2 | v >> 4; }
+
+static void row_1555_scalar(void *dst, const void *src, unsigned width) {
+	const uint16_t *s = src;
+	uint32_t *d = dst;
+	unsigned x;
+
+	for (x = 0; x < width; ++x)
+		d[x] = 0xff000000u | expand5(s[x] >> 10 & 31) << 16 | expand5(s[x] >> 5 & 31) << 8 | expand5(s[x] & 31);
+}
+
+static void row_565_scalar(void *dst, const void *src, unsigned width) {
+	const uint16_t *s = src;
+	uint32_t *d = dst;
+	unsigned x;
+
+	for (x = 0; x < width; ++x)
+		d[x] = 0xff000000u | expand5(s[x] >> 11) << 16 | expand6(s[x] >> 5 & 63) << 8 | expand5(s[x] & 31);
+}
+
+static void row_to565_scalar(void *dst, const void *src, unsigned width) {
+	const uint32_t *s = src;
+	uint16_t *d = dst;
+	unsigned x;
+
+	for (x = 0; x < width; ++x)
+		d[x] = (s[x] >> 8 & 0xf800) | (s[x] >> 5 & 0x07e0) | (s[x] >> 3 & 0x001f);
+}
+
+// libc's memcpy is already vectorized, so repacking has no SIMD variants.
+static void row_copy16(void *dst, const void *src, unsigned width) { memcpy(dst, src, width * 2); }
+static void row_copy32(void *dst, const void *src, unsigned width) { memcpy(dst, src, width * 4); }
+
+KERNEL(conv_1555_scalar, row_1555_scalar)
+KERNEL(conv_565_scalar, row_565_scalar)
+KERNEL(conv_to565_scalar, row_to565_scalar)
+KERNEL(repack16_rows, row_copy16)
+KERNEL(repack32_rows, row_copy32)
+
+static void repack16(void *dst, size_t dst_pitch, const void *src, size_t src_pitch, unsigned width, unsigned height) {
+	if (dst_pitch == src_pitch && src_pitch == width * 2)
+		memcpy(dst, src, src_pitch * height);
+	else
+		repack16_rows(dst, dst_pitch, src, src_pitch, width, height);
+}
+
+static void repack32(void *dst, size_t dst_pitch, const void *src, size_t src_pitch, unsigned width, unsigned height) {
+	if (dst_pitch == src_pitch && src_pitch == width * 4)
+		memcpy(dst, src, src_pitch * height);
+	else
+		repack32_rows(dst, dst_pitch, src, src_pitch, width, height);
+}
+
+
+#ifdef PIXCONV_X86
+// The 16-bit formats are split into channels in 16-bit lanes, then [G B]
+// and [X R] lanes are interleaved into XRGB8888.
+__attribute__((target("sse2")))
+static void row_1555_sse2(void *dst, const void *src, unsigned width) {
+	const uint16_t *s = src;
+	uint32_t *d = dst;
+	const __m128i mask = _mm_set1_epi16(31), alpha = _mm_set1_epi16((short)0xff00);
+	unsigned x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(s + x));
+		__m128i r = _mm_and_si128(_mm_srli_epi16(p, 10), mask);
+		__m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask);
+		__m128i b = _mm_and_si128(p, mask);
+
+		r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+		g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+		b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+		__m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+		__m128i xr = _mm_or_si128(r, alpha);
+
+		_mm_storeu_si128((__m128i *)(d + x), _mm_unpacklo_epi16(gb, xr));
+		_mm_storeu_si128((__m128i *)(d + x + 4), _mm_unpackhi_epi16(gb, xr));
+	}
+
+	row_1555_scalar(d + x, s + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void row_565_sse2(void *dst, const void *src, unsigned width) {
+	const uint16_t *s = src;
+	uint32_t *d = dst;
+	const __m128i mask5 = _mm_set1_epi16(31), mask6 = _mm_set1_epi16(63), alpha = _mm_set1_epi16((short)0xff00);
+	unsigned x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i p = _mm_loadu_si128((const __m128i *)(s + x));
+		__m128i r = _mm_srli_epi16(p, 11);
+		__m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+		__m128i b = _mm_and_si128(p, mask5);
+
+		r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+		g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+		b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+		__m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+		__m128i xr = _mm_or_si128(r, alpha);
+
+		_mm_storeu_si128((__m128i *)(d + x), _mm_unpacklo_epi16(gb, xr));
+		_mm_storeu_si128((__m128i *)(d + x + 4), _mm_unpackhi_epi16(gb, xr));
+	}
+
+	row_565_scalar(d + x, s + x, width - x);
+}
+
+// Packs to 565 in 32-bit lanes, sign extended so the saturating 32 to 16-bit
+// pack keeps the bits as they are.
+__attribute__((target("sse2")))
+static inline __m128i pack565_sse2(__m128i p) {
+	__m128i r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xf800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07e0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001f));
+	__m128i v = _mm_or_si128(_mm_or_si128(r, g), b);
+
+	return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("sse2")))
+static void row_to565_sse2(void *dst, const void *src, unsigned width) {
+	const uint32_t *s = src;
+	uint16_t *d = dst;
+	unsigned x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i lo = pack565_sse2(_mm_loadu_si128((const __m128i *)(s + x)));
+		__m128i hi = pack565_sse2(_mm_loadu_si128((const __m128i *)(s + x + 4)));
+
+		_mm_storeu_si128((__m128i *)(d + x), _mm_packs_epi32(lo, hi));
+	}
+
+	row_to565_scalar(d + x, s + x, width - x);
+}
+
+// AVX2 interleaves and packs within 128-bit halves, so results are put back
+// in order with a cross-lane permute.
+__attribute__((target("avx2")))
+static void row_1555_avx2(void *dst, const void *src, unsigned width) {
+	const uint16_t *s = src;
+	uint32_t *d = dst;
+	const __m256i mask = _mm256_set1_epi16(31), alpha = _mm256_set1_epi16((short)0xff00);
+	unsigned x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(s + x));
+		__m256i r = _mm256_and_si256(_mm256_srli_epi16(p, 10), mask);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask);
+		__m256i b = _mm256_and_si256(p, mask);
+
+		r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+		g = _mm256_or_si256(_mm256_slli_epi16(g, 3), _mm256_srli_epi16(g, 2));
+		b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+
+		__m256i gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+		__m256i xr = _mm256_or_si256(r, alpha);
+		__m256i lo = _mm256_unpacklo_epi16(gb, xr);
+		__m256i hi = _mm256_unpackhi_epi16(gb, xr);
+
+		_mm256_storeu_si256((__m256i *)(d + x), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(d + x + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	row_1555_scalar(d + x, s + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void row_565_avx2(void *dst, const void *src, unsigned width) {
+	const uint16_t *s = src;
+	uint32_t *d = dst;
+	const __m256i mask5 = _mm256_set1_epi16(31), mask6 = _mm256_set1_epi16(63), alpha = _mm256_set1_epi16((short)0xff00);
+	unsigned x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m256i p = _mm256_loadu_si256((const __m256i *)(s + x));
+		__m256i r = _mm256_srli_epi16(p, 11);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask6);
+		__m256i b = _mm256_and_si256(p, mask5);
+
+		r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+		g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+		b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+
+		__m256i gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+		__m256i xr = _mm256_or_si256(r, alpha);
+		__m256i lo = _mm256_unpacklo_epi16(gb, xr);
+		__m256i hi = _mm256_unpackhi_epi16(gb, xr);
+
+		_mm256_storeu_si256((__m256i *)(d + x), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(d + x + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	row_565_scalar(d + x, s + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack565_avx2(__m256i p) {
+	__m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xf800));
+	__m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x07e0));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x001f));
+	__m256i v = _mm256_or_si256(_mm256_or_si256(r, g), b);
+
+	return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static void row_to565_avx2(void *dst, const void *src, unsigned width) {
+	const uint32_t *s = src;
+	uint16_t *d = dst;
+	unsigned x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m256i lo = pack565_avx2(_mm256_loadu_si256((const __m256i *)(s + x)));
+		__m256i hi = pack565_avx2(_mm256_loadu_si256((const __m256i *)(s + x + 8)));
+
+		_mm256_storeu_si256((__m256i *)(d + x), _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8));
+	}
+
+	row_to565_scalar(d + x, s + x, width - x);
+}
+
+KERNEL(conv_1555_sse2, row_1555_sse2)
+KERNEL(conv_565_sse2, row_565_sse2)
+KERNEL(conv_to565_sse2, row_to565_sse2)
+KERNEL(conv_1555_avx2, row_1555_avx2)
+KERNEL(conv_565_avx2, row_565_avx2)
+KERNEL(conv_to565_avx2, row_to565_avx2)
+#endif
+
+
+static const pixconv_fn g_kernels[PIXCONV_KINDS][PIXCONV_ISAS] = {
+#ifdef PIXCONV_X86
+	{ conv_1555_scalar, conv_1555_sse2, conv_1555_avx2 },
+	{ conv_565_scalar, conv_565_sse2, conv_565_avx2 },
+	{ conv_to565_scalar, conv_to565_sse2, conv_to565_avx2 },
+#else
+	{ conv_1555_scalar },
+	{ conv_565_scalar },
+	{ conv_to565_scalar },
+#endif
+	{ repack16 },
+	{ repack32 },
+};
+
+
+static int isa_supported(enum pixconv_isa isa) {
+#ifdef PIXCONV_X86
+	__builtin_cpu_init();
+
+	switch (isa) {
+	case PIXCONV_SSE2: return __builtin_cpu_supports("sse2");
+	case PIXCONV_AVX2: return __builtin_cpu_supports("avx2");
+	default: break;
+	}
+#endif
+
+	return isa == PIXCONV_SCALAR;
+}
+
+
+pixconv_fn pixconv_find(enum pixconv_kind kind, enum pixconv_isa isa) {
+	if (kind >= PIXCONV_KINDS || isa >= PIXCONV_ISAS || !isa_supported(isa))
+		return NULL;
+
+	return g_kernels[kind][isa];
+}
+
+
+pixconv_fn pixconv_get(enum pixconv_kind kind, enum pixconv_isa *isa) {
+	int i;
+
+	for (i = PIXCONV_ISAS - 1; i >= 0; --i) {
+		pixconv_fn fn = pixconv_find(kind, i);
+
+		if (fn) {
+			if (isa)
+				*isa = i;
+			return fn;
+		}
+	}
+
+	return NULL;
+}
+
+
+static double now_s() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void pixconv_benchmark(void) {
+	const unsigned width = 1920, height = 1080;
+	const size_t pitch = width * 4;
+	uint8_t *src = malloc(pitch * height), *dst = malloc(pitch * height), *ref = malloc(pitch * height);
+	unsigned kind, isa;
+	size_t i;
+
+	if (!src || !dst || !ref) {
+		fprintf(stderr, "Failed to allocate the benchmark frames\n");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(1);
+	for (i = 0; i < pitch * height; ++i)
+		src[i] = rand();
+
+	printf("Converting %ux%u frames:\n", width, height);
+
+	for (kind = 0; kind < PIXCONV_KINDS; ++kind) {
+		size_t src_pitch = width * g_src_bpp[kind], dst_pitch = width * g_dst_bpp[kind];
+
+		g_kernels[kind][PIXCONV_SCALAR](ref, dst_pitch, src, src_pitch, width, height);
+
+		for (isa = 0; isa < PIXCONV_ISAS; ++isa) {
+			pixconv_fn fn = pixconv_find(kind, isa);
+			unsigned runs = 0;
+			double start, elapsed;
+
+			if (!fn)
+				continue;
+
+			start = now_s();
+			do {
+				fn(dst, dst_pitch, src, src_pitch, width, height);
+				runs++;
+			} while ((elapsed = now_s() - start) < 0.25);
+
+			printf("  %-22s %-6s %6.2f GB/s%s\n", pixconv_kind_names[kind], pixconv_isa_names[isa],
+				(double)(src_pitch + dst_pitch) * height * runs / elapsed / 1e9,
+				memcmp(dst, ref, dst_pitch * height) ? "  MISMATCH" : "");
+		}
+	}
+
+	free(src);
+	free(dst);
+	free(ref);
+}
@@ -0,0 +1,41 @@
+#ifndef PIXCONV_H
+#define PIXCONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Converts `width` pixels in each of `height` rows. Pitches are in bytes.
+typedef void (*pixconv_fn)(void *dst, size_t dst_pitch, const void *src, size_t src_pitch,
+		unsigned width, unsigned height);
+
+enum pixconv_kind {
+	PIXCONV_0RGB1555_TO_XRGB8888,
+	PIXCONV_RGB565_TO_XRGB8888,
+	PIXCONV_XRGB8888_TO_RGB565,
+	PIXCONV_REPACK16,   // same format, different pitch
+	PIXCONV_REPACK32,
+	PIXCONV_KINDS
+};
+
+enum pixconv_isa {
+	PIXCONV_SCALAR,
+	PIXCONV_SSE2,
+	PIXCONV_AVX2,
+	PIXCONV_ISAS
+};
+
+extern const char *pixconv_kind_names[PIXCONV_KINDS];
+extern const char *pixconv_isa_names[PIXCONV_ISAS];
+
+// Returns the kernel for one instruction set, or NULL if this build or CPU
+// lacks it.
+pixconv_fn pixconv_find(enum pixconv_kind kind, enum pixconv_isa isa);
+
+// Returns the fastest kernel the CPU supports, and which one it is if isa
+// isn't NULL.
+pixconv_fn pixconv_get(enum pixconv_kind kind, enum pixconv_isa *isa);
+
+// Converts full HD frames with every kernel and prints their throughput.
+void pixconv_benchmark(void);
+
+#endif